@@ -0,0 +1,43 @@
+// Definitions needed to build the SHA code on the host (for shatest.c)
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+// Keep the firmware headers out - this file stands in for them.
+#define __CONFIG_H
+#define __TYPES_H
+#define __BYTEORDER_H
+#define __STRING_H
+#define __X86_H
+
+#include <stdint.h> // uint32_t
+#include <string.h> // memcpy
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define CONFIG_TCGBIOS 1
+#ifndef CONFIG_SHA1_UNROLLED
+#define CONFIG_SHA1_UNROLLED 1
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+static inline u32 rol(u32 val, u16 rol) {
+    return (val << rol) | (val >> (32 - rol));
+}
+
+// The host is assumed to be little endian (as the firmware is).
+static inline u32 cpu_to_be32(u32 x) {
+    return __builtin_bswap32(x);
+}
+static inline u32 be32_to_cpu(u32 x) {
+    return __builtin_bswap32(x);
+}
+static inline u64 cpu_to_be64(u64 x) {
+    return __builtin_bswap64(x);
+}
+static inline u64 be64_to_cpu(u64 x) {
+    return __builtin_bswap64(x);
+}
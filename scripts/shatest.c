@@ -0,0 +1,181 @@
+// Host known-answer test and benchmark of the SHA code
+//
+// Build and run with "make shatest" - this compiles src/sha*.c with
+// scripts/sha-host.h, once for each of the SHA1 block functions.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include <stdio.h> // printf
+#include <stdlib.h> // malloc
+#include <time.h> // clock_gettime
+
+#include "sha.h" // sha_multi
+
+#define BENCH_SIZE (64*1024*1024)
+
+// Known answers from FIPS 180-2 appendices A-D
+static const struct shatest_s {
+    u8 alg, size;
+    const char *name;
+    u8 abc[SHA512_DIGEST_SIZE];
+    u8 million_a[SHA512_DIGEST_SIZE];
+} shatests[] = {
+    {
+        .alg = SHA_ALG_SHA1, .size = SHA1_DIGEST_SIZE,
+        .name = "SHA1",
+        .abc = {
+            0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a,
+            0xba, 0x3e, 0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c,
+            0x9c, 0xd0, 0xd8, 0x9d,
+        },
+        .million_a = {
+            0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4,
+            0xf6, 0x1e, 0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31,
+            0x65, 0x34, 0x01, 0x6f,
+        },
+    },
+    {
+        .alg = SHA_ALG_SHA256, .size = SHA256_DIGEST_SIZE,
+        .name = "SHA256",
+        .abc = {
+            0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+            0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+            0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+            0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+        },
+        .million_a = {
+            0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92,
+            0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+            0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e,
+            0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0,
+        },
+    },
+    {
+        .alg = SHA_ALG_SHA384, .size = SHA384_DIGEST_SIZE,
+        .name = "SHA384",
+        .abc = {
+            0xcb, 0x00, 0x75, 0x3f, 0x45, 0xa3, 0x5e, 0x8b,
+            0xb5, 0xa0, 0x3d, 0x69, 0x9a, 0xc6, 0x50, 0x07,
+            0x27, 0x2c, 0x32, 0xab, 0x0e, 0xde, 0xd1, 0x63,
+            0x1a, 0x8b, 0x60, 0x5a, 0x43, 0xff, 0x5b, 0xed,
+            0x80, 0x86, 0x07, 0x2b, 0xa1, 0xe7, 0xcc, 0x23,
+            0x58, 0xba, 0xec, 0xa1, 0x34, 0xc8, 0x25, 0xa7,
+        },
+        .million_a = {
+            0x9d, 0x0e, 0x18, 0x09, 0x71, 0x64, 0x74, 0xcb,
+            0x08, 0x6e, 0x83, 0x4e, 0x31, 0x0a, 0x4a, 0x1c,
+            0xed, 0x14, 0x9e, 0x9c, 0x00, 0xf2, 0x48, 0x52,
+            0x79, 0x72, 0xce, 0xc5, 0x70, 0x4c, 0x2a, 0x5b,
+            0x07, 0xb8, 0xb3, 0xdc, 0x38, 0xec, 0xc4, 0xeb,
+            0xae, 0x97, 0xdd, 0xd8, 0x7f, 0x3d, 0x89, 0x85,
+        },
+    },
+    {
+        .alg = SHA_ALG_SHA512, .size = SHA512_DIGEST_SIZE,
+        .name = "SHA512",
+        .abc = {
+            0xdd, 0xaf, 0x35, 0xa1, 0x93, 0x61, 0x7a, 0xba,
+            0xcc, 0x41, 0x73, 0x49, 0xae, 0x20, 0x41, 0x31,
+            0x12, 0xe6, 0xfa, 0x4e, 0x89, 0xa9, 0x7e, 0xa2,
+            0x0a, 0x9e, 0xee, 0xe6, 0x4b, 0x55, 0xd3, 0x9a,
+            0x21, 0x92, 0x99, 0x2a, 0x27, 0x4f, 0xc1, 0xa8,
+            0x36, 0xba, 0x3c, 0x23, 0xa3, 0xfe, 0xeb, 0xbd,
+            0x45, 0x4d, 0x44, 0x23, 0x64, 0x3c, 0xe8, 0x0e,
+            0x2a, 0x9a, 0xc9, 0x4f, 0xa5, 0x4c, 0xa4, 0x9f,
+        },
+        .million_a = {
+            0xe7, 0x18, 0x48, 0x3d, 0x0c, 0xe7, 0x69, 0x64,
+            0x4e, 0x2e, 0x42, 0xc7, 0xbc, 0x15, 0xb4, 0x63,
+            0x8e, 0x1f, 0x98, 0xb1, 0x3b, 0x20, 0x44, 0x28,
+            0x56, 0x32, 0xa8, 0x03, 0xaf, 0xa9, 0x73, 0xeb,
+            0xde, 0x0f, 0xf2, 0x44, 0x87, 0x7e, 0xa6, 0x0a,
+            0x4c, 0xb0, 0x43, 0x2c, 0xe5, 0x77, 0xc3, 0x1b,
+            0xeb, 0x00, 0x9c, 0x5c, 0x2c, 0x49, 0xaa, 0x2e,
+            0x4e, 0xad, 0xb2, 0x17, 0xad, 0x8c, 0xc0, 0x9b,
+        },
+    },
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Check the "abc" answer with sha_multi() and the "one million 'a'"
+// answer with sha_update() in odd sized pieces, so that both the
+// single pass and the incremental paths are covered.
+static int
+check(const struct shatest_s *t)
+{
+    struct sha_digests d;
+    sha_multi(t->alg, (u8*)"abc", 3, &d);
+    int fail = memcmp(sha_digest(&d, t->alg), t->abc, t->size) != 0;
+
+    u8 data[61];
+    memset(data, 'a', sizeof(data));
+    struct sha_ctx ctx;
+    u32 len = 1000000;
+    sha_init(&ctx, t->alg);
+    while (len) {
+        u32 n = len < sizeof(data) ? len : sizeof(data);
+        sha_update(&ctx, data, n);
+        len -= n;
+    }
+    sha_final(&ctx, &d);
+    fail |= memcmp(sha_digest(&d, t->alg), t->million_a, t->size) != 0;
+    return fail;
+}
+
+// Report the throughput of hashing 'buf' with 'algs' in one pass
+static void
+bench(const char *name, u8 algs, const u8 *buf)
+{
+    struct sha_digests d;
+    double start = now();
+    sha_multi(algs, buf, BENCH_SIZE, &d);
+    double secs = now() - start;
+    printf("  %-8s %8.1f MB/s\n", name
+           , secs > 0 ? BENCH_SIZE / secs / (1024*1024) : 0);
+}
+
+int
+main(void)
+{
+    printf("SHA1 %s block function\n"
+           , CONFIG_SHA1_UNROLLED ? "unrolled" : "loop");
+
+    u8 *buf = malloc(BENCH_SIZE);
+    if (!buf) {
+        printf("Unable to allocate benchmark buffer\n");
+        return 1;
+    }
+    u32 i, fail = 0, all = 0;
+    for (i = 0; i < BENCH_SIZE; i++)
+        buf[i] = i * 7;
+
+    for (i = 0; i < ARRAY_SIZE(shatests); i++) {
+        const struct shatest_s *t = &shatests[i];
+        int f = check(t);
+        printf("  %-8s %s\n", t->name, f ? "FAILED" : "passed");
+        fail |= f;
+        all |= t->alg;
+    }
+
+    // The sha1() entry point doesn't go through sha.c
+    u8 hash[SHA1_DIGEST_SIZE];
+    sha1((u8*)"abc", 3, hash);
+    if (memcmp(hash, shatests[0].abc, sizeof(hash))) {
+        printf("  sha1()   FAILED\n");
+        fail = 1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(shatests); i++)
+        bench(shatests[i].name, shatests[i].alg, buf);
+    bench("all", all, buf);
+
+    free(buf);
+    return fail;
+}
@@ -22,6 +22,7 @@
 #include "hw/virtio-scsi.h" // virtio_scsi_process_op
 #include "hw/nvme.h" // nvme_process_op
 #include "malloc.h" // malloc_low
+#include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
 #include "stacks.h" // call32
 #include "std/disk.h" // struct dpte_s
@@ -490,6 +491,7 @@ fill_edd(struct segoff_s edd, struct drive_s *drive_fl)
     case DTYPE_ATA_ATAPI:
         return fill_ata_edd(edd, drive_fl);
     case DTYPE_VIRTIO_BLK:
+    case DTYPE_VIRTIO_BLK_32:
     case DTYPE_VIRTIO_SCSI:
         return fill_generic_edd(
             edd, drive_fl, 0xffffffff, EDD_PCI | EDD_SCSI
@@ -539,6 +541,9 @@ default_process_op(struct disk_op_s *op)
     }
 }
 
+// Number of 16bit requests handled by drivers that used to need call32()
+u32 ModeSwitchesAvoided VARLOW;
+
 // Command dispatch for disk drivers that run in both 16bit and 32bit mode
 static int
 process_op_both(struct disk_op_s *op)
@@ -558,6 +563,14 @@ process_op_both(struct disk_op_s *op)
         return megasas_process_op(op);
     case DTYPE_MPT_SCSI:
         return mpt_scsi_process_op(op);
+    case DTYPE_VIRTIO_BLK:
+        if (MODESEGMENT) {
+            u32 count = GET_LOW(ModeSwitchesAvoided) + 1;
+            SET_LOW(ModeSwitchesAvoided, count);
+            dprintf(DEBUG_HDL_13, "disk_op in 16bit mode (%u call32 avoided)\n"
+                    , count);
+        }
+        return virtio_blk_process_op(op);
     default:
         if (!MODESEGMENT)
             return DISK_RET_EPARAM;
@@ -568,12 +581,11 @@ process_op_both(struct disk_op_s *op)
 }
 
 // Command dispatch for disk drivers that only run in 32bit mode
-int VISIBLE32FLAT
-process_op_32(struct disk_op_s *op)
+static int
+process_op_32_driver(struct disk_op_s *op)
 {
-    ASSERT32FLAT();
     switch (op->drive_fl->type) {
-    case DTYPE_VIRTIO_BLK:
+    case DTYPE_VIRTIO_BLK_32:
         return virtio_blk_process_op(op);
     case DTYPE_AHCI:
         return ahci_process_op(op);
@@ -596,6 +608,161 @@ process_op_32(struct disk_op_s *op)
     }
 }
 
+
+/****************************************************************
+ * Read-ahead cache
+ ****************************************************************/
+
+// Number of drives tracked for sequential reads
+#define BC_MAX_STREAMS 4
+
+u8 *BlockCacheBuf VARFSEG;
+
+struct block_cache_s {
+    // The cached extent (drive_fl is NULL if nothing is cached)
+    struct drive_s *drive_fl;
+    u64 lba;
+    u32 count;
+    // Where the last read of each recently used drive ended
+    struct {
+        struct drive_s *drive_fl;
+        u64 next_lba;
+    } streams[BC_MAX_STREAMS];
+    u32 next_stream;
+    u32 hits, misses;
+};
+struct block_cache_s BlockCache VARLOW;
+
+// The buffer is allocated after all drivers have been set up, so that
+// the optional cache can't take memory away from them.  The hit/miss
+// counters are reported with each read ahead (debug level 3).
+void
+block_cache_prepboot(void)
+{
+    if (!CONFIG_BLOCK_CACHE)
+        return;
+    u32 size = CONFIG_BLOCK_CACHE_SIZE * 1024;
+    if (malloc_getspace(&ZoneHigh) < size + PAGE_SIZE) {
+        dprintf(1, "Not enough memory for block cache\n");
+        return;
+    }
+    u8 *buf = memalign_high(PAGE_SIZE, size);
+    if (!buf) {
+        warn_noalloc();
+        return;
+    }
+    BlockCacheBuf = buf;
+}
+
+// Only drives that are never accessed from 16bit mode can be cached, as
+// that code can't invalidate the cache on writes.  Media changes aren't
+// detected, so removable media (sd cards, usb sticks) isn't cached.
+static int
+block_cache_drive(struct drive_s *drive_fl)
+{
+    if (drive_fl->blksize != DISK_SECTOR_SIZE || drive_fl->removable)
+        return 0;
+    switch (drive_fl->type) {
+    case DTYPE_VIRTIO_BLK_32:
+    case DTYPE_AHCI:
+    case DTYPE_UAS_32:
+    case DTYPE_VIRTIO_SCSI:
+    case DTYPE_PVSCSI:
+    case DTYPE_NVME:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Check if a read continues the previous read from the same drive and
+// remember where it ends.
+static int
+block_cache_sequential(struct disk_op_s *op)
+{
+    struct block_cache_s *bc = &BlockCache;
+    u64 next_lba = op->lba + op->count;
+    int i;
+    for (i = 0; i < BC_MAX_STREAMS; i++) {
+        if (bc->streams[i].drive_fl != op->drive_fl)
+            continue;
+        int seq = bc->streams[i].next_lba == op->lba;
+        bc->streams[i].next_lba = next_lba;
+        return seq;
+    }
+    i = bc->next_stream;
+    bc->next_stream = (i + 1) % BC_MAX_STREAMS;
+    bc->streams[i].drive_fl = op->drive_fl;
+    bc->streams[i].next_lba = next_lba;
+    return 0;
+}
+
+static int
+block_cache_process_op(struct disk_op_s *op)
+{
+    struct block_cache_s *bc = &BlockCache;
+    struct drive_s *drive_fl = op->drive_fl;
+    if (!block_cache_drive(drive_fl))
+        return process_op_32_driver(op);
+
+    if (op->command != CMD_READ) {
+        // Writes (and any other command) drop the cached extent
+        if (bc->drive_fl == drive_fl)
+            bc->drive_fl = NULL;
+        return process_op_32_driver(op);
+    }
+    if (!op->count)
+        return process_op_32_driver(op);
+
+    int seq = block_cache_sequential(op);
+    if (bc->drive_fl == drive_fl && op->lba >= bc->lba
+        && op->lba + op->count <= bc->lba + bc->count) {
+        bc->hits++;
+        u32 offset = (u32)(op->lba - bc->lba) * DISK_SECTOR_SIZE;
+        memcpy(op->buf_fl, BlockCacheBuf + offset
+               , op->count * DISK_SECTOR_SIZE);
+        return DISK_RET_SUCCESS;
+    }
+    bc->misses++;
+
+    // Read ahead if the drive is being read sequentially
+    u64 count = CONFIG_BLOCK_CACHE_SIZE * 1024 / DISK_SECTOR_SIZE;
+    if (op->lba + count > drive_fl->sectors)
+        count = op->lba < drive_fl->sectors ? drive_fl->sectors - op->lba : 0;
+    if (!seq || count <= op->count) {
+        int ret = process_op_32_driver(op);
+        if (ret && bc->drive_fl == drive_fl)
+            // Don't trust the cached data of a failing drive
+            bc->drive_fl = NULL;
+        return ret;
+    }
+
+    struct disk_op_s raop = *op;
+    raop.buf_fl = BlockCacheBuf;
+    raop.count = count;
+    bc->drive_fl = NULL;
+    int ret = process_op_32_driver(&raop);
+    if (ret)
+        return process_op_32_driver(op);
+    bc->drive_fl = drive_fl;
+    bc->lba = op->lba;
+    bc->count = count;
+    dprintf(3, "block cache: read ahead %u blocks at %u (hits=%u misses=%u)\n"
+            , (u32)count, (u32)op->lba, bc->hits, bc->misses);
+
+    memcpy(op->buf_fl, BlockCacheBuf, op->count * DISK_SECTOR_SIZE);
+    return DISK_RET_SUCCESS;
+}
+
+int VISIBLE32FLAT
+process_op_32(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    if (CONFIG_BLOCK_CACHE && BlockCacheBuf)
+        return block_cache_process_op(op);
+    return process_op_32_driver(op);
+}
+
 // Command dispatch for disk drivers that only run in 16bit mode
 static int
 process_op_16(struct disk_op_s *op)
@@ -615,6 +782,83 @@ process_op_16(struct disk_op_s *op)
     }
 }
 
+// Check if a drive's driver can reach buffers above the first megabyte
+// (the 16bit only drivers can not).
+int
+process_op_highmem(struct drive_s *drive_fl)
+{
+    switch (GET_FLATPTR(drive_fl->type)) {
+    case DTYPE_FLOPPY:
+    case DTYPE_ATA:
+    case DTYPE_RAMDISK:
+    case DTYPE_CDEMU:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+// Maximum number of blocks a driver accepts in a single request
+static u32
+process_op_max_count(struct drive_s *drive_fl)
+{
+    switch (GET_FLATPTR(drive_fl->type)) {
+    case DTYPE_NVME:
+    case DTYPE_VIRTIO_BLK:
+    case DTYPE_VIRTIO_BLK_32:
+        // These drivers split requests at the controller limits themselves
+        return 0xffff;
+    case DTYPE_AHCI:
+        // A single PRD entry describes up to 4MiB
+        return 4*1024*1024 / DISK_SECTOR_SIZE;
+    case DTYPE_USB:
+    case DTYPE_USB_32:
+        return usb_msc_max_count(drive_fl);
+    default:
+        return 64*1024 / GET_FLATPTR(drive_fl->blksize);
+    }
+}
+
+// Issue a read or write in pieces no larger than the driver supports.
+static int
+process_op_split(struct disk_op_s *op)
+{
+    u32 max = process_op_max_count(op->drive_fl);
+    if ((op->command != CMD_READ && op->command != CMD_WRITE)
+        || op->count <= max) {
+        if (MODESEGMENT)
+            return process_op_16(op);
+        return process_op_32(op);
+    }
+
+    u32 blksize = GET_FLATPTR(op->drive_fl->blksize);
+    u16 done = 0;
+    struct disk_op_s chunk = *op;
+    while (done < op->count) {
+        u16 count = op->count - done < max ? op->count - done : max;
+        chunk.lba = op->lba + done;
+        chunk.buf_fl = op->buf_fl + done * blksize;
+        chunk.count = count;
+        int ret = MODESEGMENT ? process_op_16(&chunk) : process_op_32(&chunk);
+        if (ret) {
+            if (chunk.count == count)
+                chunk.count = 0;
+            op->count = done + chunk.count;
+            return ret;
+        }
+        done += count;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+// Handle a 16bit mode request whose buffer is beyond the first megabyte
+int VISIBLE32FLAT
+process_op_high(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    return process_op_split(op);
+}
+
 // Execute a disk_op_s request.
 int
 process_op(struct disk_op_s *op)
@@ -624,14 +868,15 @@ process_op(struct disk_op_s *op)
             , op->count, op->command);
 
     int ret, origcount = op->count;
-    if (origcount * GET_FLATPTR(op->drive_fl->blksize) > 64*1024) {
-        op->count = 0;
-        return DISK_RET_EBOUNDARY;
-    }
-    if (MODESEGMENT)
-        ret = process_op_16(op);
+    u32 end = (u32)op->buf_fl + origcount * GET_FLATPTR(op->drive_fl->blksize);
+    if (MODESEGMENT && end > 0x100000
+        && (op->command == CMD_READ || op->command == CMD_WRITE)
+        && process_op_highmem(op->drive_fl))
+        // 16bit code can't reach the buffer (eg, EDD 3.0 flat address)
+        ret = call32(process_op_high, MAKE_FLATPTR(GET_SEG(SS), op)
+                     , DISK_RET_EPARAM);
     else
-        ret = process_op_32(op);
+        ret = process_op_split(op);
     if (ret && op->count == origcount)
         // If the count hasn't changed on error, assume no data transferred.
         op->count = 0;
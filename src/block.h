@@ -72,6 +72,7 @@ struct drive_s {
 #define DTYPE_AHCI_ATAPI   0x51
 #define DTYPE_VIRTIO_SCSI  0x60
 #define DTYPE_VIRTIO_BLK   0x61
+#define DTYPE_VIRTIO_BLK_32 0x62
 #define DTYPE_USB          0x70
 #define DTYPE_USB_32       0x71
 #define DTYPE_UAS          0x72
@@ -117,6 +118,8 @@ int fill_edd(struct segoff_s edd, struct drive_s *drive_fl);
 void block_setup(void);
 int default_process_op(struct disk_op_s *op);
 int process_op(struct disk_op_s *op);
+int process_op_highmem(struct drive_s *drive_fl);
+void block_cache_prepboot(void);
 int create_bounce_buf(void);
 
 #endif // block.h
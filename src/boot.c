@@ -245,6 +245,49 @@ int boot_lchs_find_ata_device(struct pci_device *pci, int chanid, int slave,
 static char **Bootorder VARVERIFY32INIT;
 static int BootorderCount;
 
+// The bootorder file compiled into a tree of path components.  Each
+// node records the first bootorder line passing through it.
+struct bootorder_node {
+    const char *name;
+    int len;
+    int prio;
+    struct bootorder_node *child, *next;
+};
+static struct bootorder_node *BootorderTree VARVERIFY32INIT;
+static u32 BootorderLookups, BootorderCompares;
+
+// Add bootorder line 'str' (with priority 'prio') to the tree.
+static int
+add_bootorder_path(const char *str, int prio)
+{
+    struct bootorder_node **pnode = &BootorderTree;
+    for (;;) {
+        const char *end = strchr(str, '/') ?: str + strlen(str);
+        int len = end - str;
+        struct bootorder_node *node;
+        for (node = *pnode; node; node = node->next)
+            if (node->len == len && memcmp(node->name, str, len) == 0)
+                break;
+        if (!node) {
+            node = malloc_tmphigh(sizeof(*node));
+            if (!node) {
+                warn_noalloc();
+                return -1;
+            }
+            memset(node, 0, sizeof(*node));
+            node->name = str;
+            node->len = len;
+            node->next = *pnode;
+            *pnode = node;
+        }
+        node->prio = prio;
+        if (!*end)
+            return 0;
+        pnode = &node->child;
+        str = end + 1;
+    }
+}
+
 static void
 loadBootOrder(void)
 {
@@ -281,18 +324,66 @@ loadBootOrder(void)
         dprintf(1, "%d: %s\n", i+1, Bootorder[i]);
         i++;
     } while (f);
+
+    // Add lines last to first, so each node ends up with the priority
+    // of the first line passing through it.
+    for (i = BootorderCount - 1; i >= 0; i--)
+        if (add_bootorder_path(Bootorder[i], i+1))
+            break;
+}
+
+// See if the path component 'glob' (terminated by a '/' or the end of
+// the string) matches the 'len' characters at 'str'.  As with
+// glob_prefix(), a '*' matches any characters up to the next glob
+// character.
+static int
+glob_component(const char *glob, const char *str, int len)
+{
+    const char *end = str + len;
+    for (;;) {
+        if (!*glob || *glob == '/')
+            return str == end;
+        if (*glob == '*') {
+            if (str == end || *str == glob[1])
+                glob++;
+            else
+                str++;
+            continue;
+        }
+        if (str == end || *glob != *str)
+            return 0;
+        glob++;
+        str++;
+    }
+}
+
+// Find the lowest priority of the nodes below 'node' matching 'glob'.
+static int
+find_prio_node(struct bootorder_node *node, const char *glob)
+{
+    const char *end = strchr(glob, '/') ?: glob + strlen(glob);
+    int prio = -1;
+    for (; node; node = node->next) {
+        BootorderCompares++;
+        if (!glob_component(glob, node->name, node->len))
+            continue;
+        int p = *end ? find_prio_node(node->child, end + 1) : node->prio;
+        if (p > 0 && (prio < 0 || p < prio))
+            prio = p;
+    }
+    return prio;
 }
 
 // Search the bootorder list for the given glob pattern.
 static int
 find_prio(const char *glob)
 {
-    dprintf(1, "Searching bootorder for: %s\n", glob);
-    int i;
-    for (i = 0; i < BootorderCount; i++)
-        if (glob_prefix(glob, Bootorder[i]))
-            return i+1;
-    return -1;
+    BootorderLookups++;
+    u32 compares = BootorderCompares;
+    int prio = find_prio_node(BootorderTree, glob);
+    dprintf(3, "Searching bootorder for: %s (prio %d, %d compares)\n"
+            , glob, prio, BootorderCompares - compares);
+    return prio;
 }
 
 int bootprio_find_pci_device(struct pci_device *pci)
@@ -416,6 +507,7 @@ int bootprio_find_usb(struct usbdevice_s *usbdev, int lun)
 
 static int BootRetryTime;
 static int CheckFloppySig = 1;
+static int FastBoot, FastBootFound;
 
 #define DEFAULT_PRIO           9999
 
@@ -424,6 +516,56 @@ static int DefaultCDPrio     = 102;
 static int DefaultHDPrio     = 103;
 static int DefaultBEVPrio    = 104;
 
+// Check if any node of a device path starts with 'name'.
+static int
+path_has_node(const char *path, const char *name)
+{
+    int len = strlen(name);
+    for (;;) {
+        path = strchr(path, '/');
+        if (!path)
+            return 0;
+        path++;
+        if (memcmp(path, name, len) == 0)
+            return 1;
+    }
+}
+
+// Fast boot - probe the controllers holding the first bootorder entry
+// and skip everything else once that device has been registered.
+static void
+loadFastBoot(void)
+{
+    if (!CONFIG_BOOTORDER || !BootorderCount
+        || !romfile_loadint("etc/fast-boot", 0)
+        || (CONFIG_BOOTMENU && romfile_loadint("etc/show-boot-menu", 1)))
+        return;
+    const char *first = Bootorder[0];
+    if (path_has_node(first, "usb@"))
+        FastBoot = FASTBOOT_USB;
+    else if (path_has_node(first, "disk@") || path_has_node(first, "namespace@")
+             || path_has_node(first, "floppy@"))
+        FastBoot = FASTBOOT_BLOCK;
+    else
+        return;
+    dprintf(1, "fast boot: probing %s devices first for %s\n"
+            , FastBoot == FASTBOOT_USB ? "usb" : "block", first);
+}
+
+// Return which class of devices holds the first boot device (or 0).
+int
+fastboot_target(void)
+{
+    return FastBoot;
+}
+
+// Check if the first boot device has been registered.
+int
+fastboot_found(void)
+{
+    return FastBoot && FastBootFound;
+}
+
 void
 boot_init(void)
 {
@@ -455,6 +597,7 @@ boot_init(void)
 
     loadBootOrder();
     loadBiosGeometry();
+    loadFastBoot();
 }
 
 
@@ -497,6 +640,8 @@ bootentry_add(int type, int prio, u32 data, const char *desc)
     be->priority = prio;
     be->data = data;
     be->description = desc ?: "?";
+    if (prio == 1 && FastBoot)
+        FastBootFound = 1;
     dprintf(3, "Registering bootable: %s (type:%d prio:%d data:%x)\n"
             , be->description, type, prio, data);
 
@@ -774,6 +919,9 @@ bcv_prepboot(void)
         return;
 
     int haltprio = find_prio("HALT");
+    if (BootorderCount)
+        dprintf(1, "bootorder: %d lines, %d lookups, %d component compares\n"
+                , BootorderCount, BootorderLookups, BootorderCompares);
     if (haltprio >= 0)
         bootentry_add(IPL_TYPE_HALT, haltprio, 0, "HALT");
 
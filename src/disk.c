@@ -174,7 +174,20 @@ extended_access(struct bregs *regs, struct drive_s *drive_fl, u16 command)
         return;
     }
 
-    dop.buf_fl = SEGOFF_TO_FLATPTR(GET_FARVAR(regs->ds, param_far->data));
+    struct segoff_s data = GET_FARVAR(regs->ds, param_far->data);
+    if (data.segoff == 0xffffffff
+        && GET_FARVAR(regs->ds, param_far->size) >= sizeof(*param_far)) {
+        // 64bit flat address (EDD 3.0) - only the low 4GiB are reachable
+        u64 data64 = GET_FARVAR(regs->ds, param_far->data64);
+        if (data64 >> 32 || !process_op_highmem(drive_fl)) {
+            warn_invalid(regs);
+            disk_ret(regs, DISK_RET_EPARAM);
+            return;
+        }
+        dop.buf_fl = (void*)(u32)data64;
+    } else {
+        dop.buf_fl = SEGOFF_TO_FLATPTR(data);
+    }
     dop.count = GET_FARVAR(regs->ds, param_far->count);
     if (! dop.count) {
         // Nothing to do.
@@ -409,7 +422,9 @@ static void
 disk_1341(struct bregs *regs, struct drive_s *drive_fl)
 {
     regs->bx = 0xaa55;  // install check
-    regs->cx = 0x0007;  // ext disk access and edd, removable supported
+    regs->cx = 0x0007;  // ext disk access and edd, removable media support
+    if (process_op_highmem(drive_fl))
+        regs->cx |= 0x0008; // 64bit flat address support
     disk_ret(regs, DISK_RET_SUCCESS);
     regs->ah = 0x30;    // EDD 3.0
 }
@@ -14,8 +14,10 @@
 #include "output.h" // dprintf
 #include "paravirt.h" // PlatformRunningOn
 #include "romfile.h" // romfile_findprefix
+#include "sha.h" // struct sha_ctx
 #include "stacks.h" // yield
 #include "string.h" // memset
+#include "tcgbios.h" // tpm_measure_data
 #include "util.h" // coreboot_preinit
 
 
@@ -507,6 +509,8 @@ cbfs_run_payload(struct cbfs_file *fhdr)
     dprintf(1, "Run %s\n", fhdr->filename);
     struct cbfs_payload *pay = (void*)fhdr + be32_to_cpu(fhdr->offset);
     struct cbfs_payload_segment *seg = pay->segments;
+    struct sha_ctx ctx;
+    tpm_measure_start(&ctx);
     for (;;) {
         void *src = (void*)pay + be32_to_cpu(seg->offset);
         void *dest = (void*)(u32)be64_to_cpu(seg->load_addr);
@@ -518,6 +522,7 @@ cbfs_run_payload(struct cbfs_file *fhdr)
             memset(dest, 0, dest_len);
             break;
         case PAYLOAD_SEGMENT_ENTRY: {
+            tpm_add_cbfs_payload(&ctx, fhdr->filename);
             dprintf(1, "Calling addr %p\n", dest);
             void (*func)(void) = dest;
             func();
@@ -541,6 +546,7 @@ cbfs_run_payload(struct cbfs_file *fhdr)
                         , seg->compression);
                 return;
             }
+            tpm_measure_data(&ctx, dest, src_len);
             if (dest_len > src_len)
                 memset(dest + src_len, 0, dest_len - src_len);
             break;
@@ -24,6 +24,15 @@
 #define AHCI_RESET_TIMEOUT     500 // 500 miliseconds
 #define AHCI_LINK_TIMEOUT       10 // 10 miliseconds
 
+#define AHCI_BOUNCE_SIZE (16*1024)
+
+#define AHCI_NCQ_MAX    8   // maximum number of queued commands per port
+// Sectors covered by one PRD entry (4MiB byte count limit)
+#define AHCI_PRD_MAX_SECTORS (4*1024*1024 / DISK_SECTOR_SIZE)
+
+// Word aligned staging buffer for transfers from/to odd addresses
+u8 *ahci_bounce_fl VARFSEG;
+
 // prepare sata command fis
 static void sata_prep_simple(struct sata_cmd_fis *fis, u8 command)
 {
@@ -60,6 +69,24 @@ static void sata_prep_readwrite(struct sata_cmd_fis *fis,
     fis->device       = ((lba >> 24) & 0xf) | ATA_CB_DH_LBA;
 }
 
+static void sata_prep_fpdma(struct sata_cmd_fis *fis, u64 lba, u16 count,
+                            u8 tag, int iswrite)
+{
+    memset_fl(fis, 0, sizeof(*fis));
+    fis->command      = (iswrite ? ATA_CMD_WRITE_FPDMA_QUEUED
+                         : ATA_CMD_READ_FPDMA_QUEUED);
+    fis->feature      = count;
+    fis->feature2     = count >> 8;
+    fis->sector_count = tag << 3;
+    fis->lba_low      = lba;
+    fis->lba_mid      = lba >> 8;
+    fis->lba_high     = lba >> 16;
+    fis->lba_low2     = lba >> 24;
+    fis->lba_mid2     = lba >> 32;
+    fis->lba_high2    = lba >> 40;
+    fis->device       = ATA_CB_DH_LBA;
+}
+
 static void sata_prep_atapi(struct sata_cmd_fis *fis, u16 blocksize)
 {
     memset_fl(fis, 0, sizeof(*fis));
@@ -100,11 +127,56 @@ static void ahci_port_writel(struct ahci_ctrl_s *ctrl, u32 pnr, u32 reg, u32 val
     ahci_ctrl_writel(ctrl, ctrl_reg, val);
 }
 
+// non-queued error recovery (AHCI 1.3 section 6.2.2.1), returns
+// non-zero if the device was reset
+static int ahci_port_recover(struct ahci_ctrl_s *ctrl, u32 pnr, int reset)
+{
+    u32 val;
+    // Clears PxCMD.ST to 0 to reset the PxCI register
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+
+    // waits for PxCMD.CR to clear to 0
+    while (1) {
+        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if ((val & PORT_CMD_LIST_ON) == 0)
+            break;
+        yield();
+    }
+
+    // Clears any error bits in PxSERR to enable capturing new errors
+    val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+    // Clears status bits in PxIS as appropriate
+    val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+
+    // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
+    // a COMRESET to the device to put it in an idle state
+    val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ))
+        reset = 1;
+    if (reset) {
+        dprintf(2, "AHCI/%d: issue comreset\n", pnr);
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
+        mdelay (1);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+    }
+
+    // Sets PxCMD.ST to 1 to enable issuing new commands
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+    return reset;
+}
+
 // submit ahci command + wait for result
 static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
                         void *buffer, u32 bsize)
 {
-    u32 val, status, success, flags, intbits, error;
+    u32 status, success, flags, intbits, error;
     struct ahci_ctrl_s *ctrl = port_gf->ctrl;
     struct ahci_cmd_s  *cmd  = port_gf->cmd;
     struct ahci_fis_s  *fis  = port_gf->fis;
@@ -168,45 +240,125 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
     } else {
         dprintf(2, "AHCI/%d: ... finished, status 0x%x, ERROR 0x%x\n", pnr,
                 status, error);
+        ahci_port_recover(ctrl, pnr, 0);
+    }
+    return success ? 0 : -1;
+}
 
-        // non-queued error recovery (AHCI 1.3 section 6.2.2.1)
-        // Clears PxCMD.ST to 0 to reset the PxCI register
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+// queued error recovery (AHCI 1.3 section 6.2.2.2)
+static void ahci_ncq_recover(struct ahci_port_s *port_gf)
+{
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr = port_gf->pnr;
+    if (ahci_port_recover(ctrl, pnr, 0))
+        // COMRESET already aborted all outstanding commands
+        return;
 
-        // waits for PxCMD.CR to clear to 0
-        while (1) {
-            val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-            if ((val & PORT_CMD_LIST_ON) == 0)
-                break;
-            yield();
-        }
+    // Reading the NCQ command error log aborts the outstanding queued
+    // commands and takes the device out of its error state.
+    struct ahci_cmd_s *cmd = port_gf->cmd;
+    u8 *buf_fl = ahci_bounce_fl;
+    if (!buf_fl)
+        buf_fl = bounce_buf_fl;
+    sata_prep_simple(&cmd->fis, ATA_CMD_READ_LOG_EXT);
+    cmd->fis.lba_low = 0x10; /* NCQ command error log */
+    cmd->fis.sector_count = 1;
+    if (ahci_command(port_gf, 0, 0, buf_fl, DISK_SECTOR_SIZE) < 0) {
+        ahci_port_recover(ctrl, pnr, 1);
+        return;
+    }
+    dprintf(2, "AHCI/%d: ncq error log: tag 0x%x, status 0x%x, error 0x%x\n"
+            , pnr, buf_fl[0], buf_fl[2], buf_fl[3]);
+}
 
-        // Clears any error bits in PxSERR to enable capturing new errors
-        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
-        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+// wait for all queued commands in 'slots' to complete
+static int ahci_ncq_wait(struct ahci_port_s *port_gf, u32 slots)
+{
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr = port_gf->pnr, intbits;
 
-        // Clears status bits in PxIS as appropriate
-        val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+    u32 end = timer_calc(AHCI_REQUEST_TIMEOUT);
+    for (;;) {
+        intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        if (intbits & PORT_IRQ_ERROR) {
+            dprintf(2, "AHCI/%d: queued command failed, intbits 0x%x,"
+                    " tf 0x%x\n", pnr, intbits
+                    , ahci_port_readl(ctrl, pnr, PORT_TFDATA));
+            ahci_ncq_recover(port_gf);
+            return -1;
+        }
+        u32 busy = (ahci_port_readl(ctrl, pnr, PORT_SCR_ACT)
+                    | ahci_port_readl(ctrl, pnr, PORT_CMD_ISSUE));
+        if (!(busy & slots))
+            break;
+        if (timer_check(end)) {
+            warn_timeout();
+            ahci_ncq_recover(port_gf);
+            return -1;
+        }
+        yield();
+    }
+    if (intbits)
+        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    return 0;
+}
 
-        // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
-        // a COMRESET to the device to put it in an idle state
-        val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-        if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
-            dprintf(2, "AHCI/%d: issue comreset\n", pnr);
-            val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
-            // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
-            mdelay (1);
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+// read/write using native command queuing, keeping up to ncq_depth
+// commands outstanding; op->buf_fl must be word aligned
+static int
+ahci_ncq_readwrite(struct disk_op_s *op, int iswrite)
+{
+    struct ahci_port_s *port_gf = container_of(
+        op->drive_fl, struct ahci_port_s, drive);
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    struct ahci_list_s *list = port_gf->list;
+    u32 pnr = port_gf->pnr, depth = port_gf->ncq_depth;
+    u16 done = 0;
+
+    // Spread the request evenly over the queue, so that a single batch
+    // covers it unless the pieces don't fit a PRD entry.
+    u32 chunk = DIV_ROUND_UP(op->count, depth);
+    if (chunk > AHCI_PRD_MAX_SECTORS)
+        chunk = AHCI_PRD_MAX_SECTORS;
+
+    while (done < op->count) {
+        u32 slots = 0, tag;
+        for (tag = 0; tag < depth && done < op->count; tag++) {
+            u16 count = op->count - done;
+            if (count > chunk)
+                count = chunk;
+            struct ahci_cmd_s *cmd = (void*)port_gf->ncq_cmd
+                + tag * AHCI_CMD_TABLE_SIZE;
+            sata_prep_fpdma(&cmd->fis, op->lba + done, count, tag, iswrite);
+            cmd->fis.reg       = 0x27;
+            cmd->fis.pmp_type  = 1 << 7; /* cmd fis */
+            cmd->prdt[0].base  = (u32)(op->buf_fl + done * DISK_SECTOR_SIZE);
+            cmd->prdt[0].baseu = 0;
+            cmd->prdt[0].flags = count * DISK_SECTOR_SIZE - 1;
+
+            list[tag].flags = ((1 << 16) | /* one prd entry */
+                               (iswrite ? AHCI_CMD_WRITE : 0) |
+                               (5 << 0)); /* fis length (dwords) */
+            list[tag].bytes = 0;
+            list[tag].base  = (u32)cmd;
+            list[tag].baseu = 0;
+
+            slots |= 1 << tag;
+            done += count;
         }
 
-        // Sets PxCMD.ST to 1 to enable issuing new commands
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+        dprintf(8, "AHCI/%d: queue %s, slots 0x%x\n", pnr
+                , iswrite ? "write" : "read", slots);
+        u32 intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        if (intbits)
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+        // issue the whole batch at once
+        ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, slots);
+        ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, slots);
+        if (ahci_ncq_wait(port_gf, slots) < 0)
+            return DISK_RET_EBADTRACK;
     }
-    return success ? 0 : -1;
+    return DISK_RET_SUCCESS;
 }
 
 #define CDROM_CDB_SIZE 12
@@ -256,38 +408,41 @@ static int
 ahci_disk_readwrite(struct disk_op_s *op, int iswrite)
 {
     // if caller's buffer is word aligned, use it directly
-    if (((u32) op->buf_fl & 1) == 0)
+    if (((u32) op->buf_fl & 1) == 0) {
+        struct ahci_port_s *port_gf = container_of(
+            op->drive_fl, struct ahci_port_s, drive);
+        // Requests that fit one PRD entry are sent as a single command;
+        // on a queued command error retry the request without queuing.
+        if (port_gf->ncq_depth > 1 && op->count > AHCI_PRD_MAX_SECTORS
+            && ahci_ncq_readwrite(op, iswrite) == DISK_RET_SUCCESS)
+            return DISK_RET_SUCCESS;
         return ahci_disk_readwrite_aligned(op, iswrite);
+    }
 
-    // Use a word aligned buffer for AHCI I/O
+    // Use a word aligned buffer for AHCI I/O, staging as many sectors at
+    // once as it holds.
     int rc;
     struct disk_op_s localop = *op;
-    u8 *alignedbuf_fl = bounce_buf_fl;
-    u8 *position = op->buf_fl;
-
+    u8 *alignedbuf_fl = ahci_bounce_fl;
+    u16 max = AHCI_BOUNCE_SIZE / DISK_SECTOR_SIZE, block;
+    if (!alignedbuf_fl) {
+        alignedbuf_fl = bounce_buf_fl;
+        max = CDROM_SECTOR_SIZE / DISK_SECTOR_SIZE;
+    }
     localop.buf_fl = alignedbuf_fl;
-    localop.count = 1;
-
-    if (iswrite) {
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            memcpy_fl (alignedbuf_fl, position, DISK_SECTOR_SIZE);
-            rc = ahci_disk_readwrite_aligned (&localop, 1);
-            if (rc)
-                return rc;
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
-    } else { // read
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            rc = ahci_disk_readwrite_aligned (&localop, 0);
-            if (rc)
-                return rc;
-            memcpy_fl (position, alignedbuf_fl, DISK_SECTOR_SIZE);
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
+
+    for (block = 0; block < op->count; block += localop.count) {
+        u8 *position = op->buf_fl + block * DISK_SECTOR_SIZE;
+        localop.lba = op->lba + block;
+        localop.count = op->count - block < max ? op->count - block : max;
+        u32 size = localop.count * DISK_SECTOR_SIZE;
+        if (iswrite)
+            memcpy_fl(alignedbuf_fl, position, size);
+        rc = ahci_disk_readwrite_aligned(&localop, iswrite);
+        if (rc)
+            return rc;
+        if (!iswrite)
+            memcpy_fl(position, alignedbuf_fl, size);
     }
     return DISK_RET_SUCCESS;
 }
@@ -410,6 +565,17 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
         return NULL;
     }
 
+    if (port->ncq_depth > 1) {
+        u32 size = port->ncq_depth * AHCI_CMD_TABLE_SIZE;
+        port->ncq_cmd = memalign_high(AHCI_CMD_TABLE_SIZE, size);
+        if (port->ncq_cmd) {
+            memset(port->ncq_cmd, 0, size);
+        } else {
+            warn_noalloc();
+            port->ncq_depth = 0;
+        }
+    }
+
     ahci_port_writel(port->ctrl, port->pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(port->ctrl, port->pnr, PORT_FIS_ADDR, (u32)port->fis);
 
@@ -495,6 +661,11 @@ static int ahci_port_setup(struct ahci_port_s *port)
 
     if (!port->atapi) {
         // found disk (ata)
+        if (!ahci_bounce_fl) {
+            ahci_bounce_fl = memalign_high(PAGE_SIZE, AHCI_BOUNCE_SIZE);
+            if (!ahci_bounce_fl)
+                warn_noalloc();
+        }
         port->drive.type = DTYPE_AHCI;
         port->drive.blksize = DISK_SECTOR_SIZE;
         port->drive.pchs.cylinder = buffer[1];
@@ -507,6 +678,17 @@ static int ahci_port_setup(struct ahci_port_s *port)
         else
             sectors = *(u32*)&buffer[60]; // word 60 and word 61
         port->drive.sectors = sectors;
+        // word 76 bit 8 - ncq support, word 75 - queue depth - 1
+        if ((ctrl->caps & HOST_CAP_NCQ) && buffer[76] != 0xffff
+            && (buffer[76] & (1 << 8))) {
+            u32 depth = (buffer[75] & 0x1f) + 1;
+            if (depth > HOST_CAP_NCS(ctrl->caps))
+                depth = HOST_CAP_NCS(ctrl->caps);
+            if (depth > AHCI_NCQ_MAX)
+                depth = AHCI_NCQ_MAX;
+            port->ncq_depth = depth;
+            dprintf(2, "AHCI/%d: ncq depth %d\n", port->pnr, depth);
+        }
         u64 adjsize = sectors >> 11;
         char adjprefix = 'M';
         if (adjsize >= (1 << 16)) {
@@ -36,6 +36,9 @@ struct ahci_ctrl_s {
     u32 ports;
 };
 
+/* command table, one per command slot */
+#define AHCI_CMD_TABLE_SIZE 256
+
 struct ahci_cmd_s {
     struct sata_cmd_fis fis;
     u8 atapi[0x20];
@@ -75,6 +78,8 @@ struct ahci_port_s {
     struct ahci_list_s *list;
     struct ahci_fis_s  *fis;
     struct ahci_cmd_s  *cmd;
+    struct ahci_cmd_s  *ncq_cmd; /* ncq_depth command tables */
+    u32                ncq_depth;
     u32                pnr;
     u32                atapi;
     char               *desc;
@@ -109,6 +114,7 @@ int ahci_atapi_process_op(struct disk_op_s *op);
 #define HOST_CTL_AHCI_EN          (1 << 31) /* AHCI enabled */
 
 /* HOST_CAP bits */
+#define HOST_CAP_NCS(caps)        ((((caps) >> 8) & 0x1f) + 1) /* slots */
 #define HOST_CAP_SSC              (1 << 14) /* Slumber capable */
 #define HOST_CAP_AHCI             (1 << 18) /* AHCI only */
 #define HOST_CAP_CLO              (1 << 24) /* Command List Override support */
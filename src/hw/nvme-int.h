@@ -105,6 +105,11 @@ struct nvme_ctrl {
 
     struct nvme_sq io_sq;
     struct nvme_cq io_cq;
+
+    /* Page aligned PRP lists, one page of NVME_MAX_PRPL_ENTRIES entries
+       for each command in flight. */
+    u64 *prpl;
+    u32 prpl_pages;
 };
 
 struct nvme_namespace {
@@ -117,6 +122,7 @@ struct nvme_namespace {
 
     u32 block_size;
     u32 metadata_size;
+    u32 max_req_size;           /* in blocks */
 
     /* Page aligned buffer of size NVME_PAGE_SIZE. */
     char *dma_buffer;
@@ -130,8 +136,12 @@ struct nvme_identify_ctrl {
     char sn[20];
     char mn[40];
     char fr[8];
+    u8 rab;
+    u8 ieee[3];
+    u8 cmic;
+    u8 mdts;                    /* max data transfer size (log2 pages) */
 
-    char _boring[516 - 72];
+    char _boring[516 - 78];
 
     u32 nn;                     /* number of namespaces */
 };
@@ -189,6 +199,13 @@ union nvme_identify {
 #define NVME_CQE_DW3_P (1U << 16)
 
 #define NVME_PAGE_SIZE 4096
+#define NVME_PAGE_MASK ~(NVME_PAGE_SIZE - 1)
+
+/* Number of entries in a PRP list that fits in one page. */
+#define NVME_MAX_PRPL_ENTRIES (NVME_PAGE_SIZE / sizeof(u64))
+
+/* Maximum number of I/O commands kept in flight for one request. */
+#define NVME_MAX_INFLIGHT 8
 
 /* Length for the queue entries. */
 #define NVME_SQE_SIZE_LOG 6
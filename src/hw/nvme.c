@@ -101,16 +101,12 @@ nvme_error_cqe(void)
     return r;
 }
 
-static struct nvme_cqe
-nvme_consume_cqe(struct nvme_sq *sq)
+/* Advance past the next (ready) completion queue entry and return it. The
+   controller is not told about it - see nvme_consume_cqe(). */
+static struct nvme_cqe *
+nvme_next_cqe(struct nvme_sq *sq)
 {
     struct nvme_cq *cq = sq->cq;
-
-    if (!nvme_poll_cq(cq)) {
-        /* Cannot consume a completion queue entry, if there is none ready. */
-        return nvme_error_cqe();
-    }
-
     struct nvme_cqe *cqe = &cq->cqe[cq->head];
     u16 cq_next_head = (cq->head + 1) & cq->common.mask;
     dprintf(4, "cq %p head %u -> %u\n", cq, cq->head, cq_next_head);
@@ -126,16 +122,32 @@ nvme_consume_cqe(struct nvme_sq *sq)
         dprintf(4, "sq %p advanced to %u\n", sq, cqe->sq_head);
     }
 
+    return cqe;
+}
+
+static struct nvme_cqe
+nvme_consume_cqe(struct nvme_sq *sq)
+{
+    struct nvme_cq *cq = sq->cq;
+
+    if (!nvme_poll_cq(cq)) {
+        /* Cannot consume a completion queue entry, if there is none ready. */
+        return nvme_error_cqe();
+    }
+
+    struct nvme_cqe *cqe = nvme_next_cqe(sq);
+
     /* Tell the controller that we consumed the completion. */
     writel(cq->common.dbl, cq->head);
 
     return *cqe;
 }
 
+static const unsigned nvme_timeout = 5000 /* ms */;
+
 static struct nvme_cqe
 nvme_wait(struct nvme_sq *sq)
 {
-    static const unsigned nvme_timeout = 5000 /* ms */;
     u32 to = timer_calc(nvme_timeout);
     while (!nvme_poll_cq(sq->cq)) {
         yield();
@@ -149,12 +161,54 @@ nvme_wait(struct nvme_sq *sq)
     return nvme_consume_cqe(sq);
 }
 
+/* Wait for the completions of 'count' commands. All entries that are ready
+   are reaped at once and acknowledged with a single doorbell write. Returns
+   the number of commands that failed (all of them on a timeout). */
+static int
+nvme_wait_batch(struct nvme_sq *sq, int count)
+{
+    struct nvme_cq *cq = sq->cq;
+    u32 to = timer_calc(nvme_timeout);
+    int failed = 0;
+
+    while (count) {
+        if (!nvme_poll_cq(cq)) {
+            yield();
+
+            if (timer_check(to)) {
+                warn_timeout();
+                return failed + count;
+            }
+            continue;
+        }
+
+        do {
+            struct nvme_cqe *cqe = nvme_next_cqe(sq);
+            if (!nvme_is_cqe_success(cqe)) {
+                dprintf(2, "io: %08x %08x %08x %08x\n",
+                        cqe->dword[0], cqe->dword[1], cqe->dword[2],
+                        cqe->dword[3]);
+                failed++;
+            }
+            count--;
+        } while (count && nvme_poll_cq(cq));
+
+        /* Tell the controller that we consumed the completions. */
+        writel(cq->common.dbl, cq->head);
+    }
+
+    return failed;
+}
+
 /* Returns the next submission queue entry (or NULL if the queue is full). It
-   also fills out Command Dword 0 and clears the rest. */
+   also fills out Command Dword 0 and clears the rest. 'data' may start at a
+   dword aligned offset into a page, 'data2' is either the second page or a
+   (qword aligned) pointer to a PRP list. */
 static struct nvme_sqe *
-nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
+nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data,
+                  void *data2)
 {
-    if (((sq->head + 1) & sq->common.mask) == sq->tail) {
+    if (((sq->tail + 1) & sq->common.mask) == sq->head) {
         dprintf(3, "submission queue is full");
         return NULL;
     }
@@ -166,24 +220,41 @@ nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
     sqe->cdw0 = opc | (sq->tail << 16 /* CID */);
     sqe->mptr = (u32)metadata;
     sqe->dptr_prp1 = (u32)data;
+    sqe->dptr_prp2 = (u32)data2;
 
-    if (sqe->dptr_prp1 & (NVME_PAGE_SIZE - 1)) {
-        /* Data buffer not page aligned. */
+    if ((sqe->dptr_prp1 & 0x3) || (sqe->dptr_prp2 & 0x7)) {
+        /* Data buffer misaligned. */
         warn_internalerror();
     }
 
     return sqe;
 }
 
-/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+/* Call this after you've filled out an sqe that you've got from
+   nvme_get_next_sqe. The controller only sees it after the next
+   nvme_ring_sq(). */
 static void
-nvme_commit_sqe(struct nvme_sq *sq)
+nvme_queue_sqe(struct nvme_sq *sq)
 {
     dprintf(4, "sq %p commit_sqe %u\n", sq, sq->tail);
     sq->tail = (sq->tail + 1) & sq->common.mask;
+}
+
+/* Tell the controller about all queued sqes. */
+static void
+nvme_ring_sq(struct nvme_sq *sq)
+{
     writel(sq->common.dbl, sq->tail);
 }
 
+/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+static void
+nvme_commit_sqe(struct nvme_sq *sq)
+{
+    nvme_queue_sqe(sq);
+    nvme_ring_sq(sq);
+}
+
 /* Perform an identify command on the admin queue and return the resulting
    buffer. This may be a NULL pointer, if something failed. This function
    cannot be used after initialization, because it uses buffers in tmp zone. */
@@ -200,7 +271,7 @@ nvme_admin_identify(struct nvme_ctrl *ctrl, u8 cns, u32 nsid)
     struct nvme_sqe *cmd_identify;
     cmd_identify = nvme_get_next_sqe(&ctrl->admin_sq,
                                      NVME_SQE_OPC_ADMIN_IDENTIFY, NULL,
-                                     identify_buf);
+                                     identify_buf, NULL);
 
     if (!cmd_identify) {
         warn_internalerror();
@@ -238,7 +309,8 @@ nvme_admin_identify_ns(struct nvme_ctrl *ctrl, u32 ns_id)
 }
 
 static void
-nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
+nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id,
+              u8 mdts)
 {
     ns->ctrl  = ctrl;
     ns->ns_id = ns_id;
@@ -275,6 +347,13 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
         goto free_buffer;
     }
 
+    /* Limit requests to what a single PRP list page can describe (and to
+       the controller's maximum data transfer size). */
+    u32 max_pages = NVME_MAX_PRPL_ENTRIES;
+    if (mdts && mdts < 9 && (1U << mdts) < max_pages)
+        max_pages = 1U << mdts;
+    ns->max_req_size = (max_pages - 1) * (NVME_PAGE_SIZE / ns->block_size);
+
     ns->drive.cntl_id   = ns - ctrl->ns;
     ns->drive.removable = 0;
     ns->drive.type      = DTYPE_NVME;
@@ -282,6 +361,10 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
     ns->drive.sectors   = ns->lba_count;
 
     ns->dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+    if (!ns->dma_buffer) {
+        warn_noalloc();
+        goto free_buffer;
+    }
 
     char *desc = znprintf(MAXDESCSIZE, "NVMe NS %u: %llu MiB (%llu %u-byte "
                           "blocks + %u-byte metadata)\n",
@@ -329,7 +412,7 @@ nvme_create_io_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq, u16 q_idx)
 
     cmd_create_cq = nvme_get_next_sqe(&ctrl->admin_sq,
                                       NVME_SQE_OPC_ADMIN_CREATE_IO_CQ, NULL,
-                                      cq->cqe);
+                                      cq->cqe, NULL);
     if (!cmd_create_cq) {
         goto err_destroy_cq;
     }
@@ -373,7 +456,7 @@ nvme_create_io_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq, u16 q_idx, struct
 
     cmd_create_sq = nvme_get_next_sqe(&ctrl->admin_sq,
                                       NVME_SQE_OPC_ADMIN_CREATE_IO_SQ, NULL,
-                                      sq->sqe);
+                                      sq->sqe, NULL);
     if (!cmd_create_sq) {
         goto err_destroy_sq;
     }
@@ -401,41 +484,47 @@ err:
     return -1;
 }
 
-/* Reads count sectors into buf. Returns DISK_RET_*. The buffer cannot cross
-   page boundaries. */
+/* Queue a read or write of count sectors from/to the memory described by prp1
+   and prp2. The command is only started by the next nvme_ring_sq(). Returns
+   0 on success. */
 static int
-nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
-                  int write)
+nvme_io_queue(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
+              u16 count, int write)
 {
-    u32 buf_addr = (u32)buf;
-
-    if ((buf_addr & 0x3) ||
-        ((buf_addr & ~(NVME_PAGE_SIZE - 1)) !=
-         ((buf_addr + ns->block_size * count - 1) & ~(NVME_PAGE_SIZE - 1)))) {
-        /* Buffer is misaligned or crosses page boundary */
+    if (((u32)prp1 & 0x3) || ((u32)prp2 & 0x7)) {
+        /* Buffer is misaligned */
         warn_internalerror();
-        return DISK_RET_EBADTRACK;
+        return -1;
     }
 
     struct nvme_sqe *io_read = nvme_get_next_sqe(&ns->ctrl->io_sq,
                                                  write ? NVME_SQE_OPC_IO_WRITE
                                                        : NVME_SQE_OPC_IO_READ,
-                                                 NULL, buf);
+                                                 NULL, prp1, prp2);
+    if (!io_read)
+        return -1;
     io_read->nsid = ns->ns_id;
     io_read->dword[10] = (u32)lba;
     io_read->dword[11] = (u32)(lba >> 32);
     io_read->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
 
-    nvme_commit_sqe(&ns->ctrl->io_sq);
+    nvme_queue_sqe(&ns->ctrl->io_sq);
+    return 0;
+}
 
-    struct nvme_cqe cqe = nvme_wait(&ns->ctrl->io_sq);
+/* Reads or writes count sectors from/to the memory described by prp1 and
+   prp2. Returns DISK_RET_*. */
+static int
+nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
+                  u16 count, int write)
+{
+    if (nvme_io_queue(ns, lba, prp1, prp2, count, write))
+        return DISK_RET_EBADTRACK;
 
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "read io: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+    nvme_ring_sq(&ns->ctrl->io_sq);
 
+    if (nvme_wait_batch(&ns->ctrl->io_sq, 1))
         return DISK_RET_EBADTRACK;
-    }
 
     return DISK_RET_SUCCESS;
 }
@@ -549,6 +638,7 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
             identify->nn, (identify->nn == 1) ? "" : "s");
 
     ctrl->ns_count = identify->nn;
+    u8 mdts = identify->mdts;
     free(identify);
 
     if ((ctrl->ns_count == 0) || nvme_create_io_queues(ctrl)) {
@@ -557,22 +647,39 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
         goto err_destroy_admin_sq;
     }
 
+    /* Only one request per controller is processed at a time, so the
+       PRP lists are shared by all namespaces. */
+    ctrl->prpl_pages = NVME_MAX_INFLIGHT;
+    ctrl->prpl = zalloc_page_aligned(&ZoneHigh
+                                     , ctrl->prpl_pages * NVME_PAGE_SIZE);
+    if (!ctrl->prpl) {
+        /* Fall back to a single command in flight */
+        ctrl->prpl_pages = 1;
+        ctrl->prpl = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+        if (!ctrl->prpl) {
+            warn_noalloc();
+            goto err_destroy_ioq;
+        }
+    }
+
     ctrl->ns = malloc_fseg(sizeof(*ctrl->ns) * ctrl->ns_count);
     if (!ctrl->ns) {
         warn_noalloc();
-        goto err_destroy_ioq;
+        goto err_free_prpl;
     }
     memset(ctrl->ns, 0, sizeof(*ctrl->ns) * ctrl->ns_count);
 
     /* Populate namespace IDs */
     int ns_idx;
     for (ns_idx = 0; ns_idx < ctrl->ns_count; ns_idx++) {
-        nvme_probe_ns(ctrl, &ctrl->ns[ns_idx], ns_idx + 1);
+        nvme_probe_ns(ctrl, &ctrl->ns[ns_idx], ns_idx + 1, mdts);
     }
 
     dprintf(3, "NVMe initialization complete!\n");
     return 0;
 
+ err_free_prpl:
+    free(ctrl->prpl);
  err_destroy_ioq:
     nvme_destroy_io_queues(ctrl);
  err_destroy_admin_sq:
@@ -644,36 +751,113 @@ nvme_scan(void)
     }
 }
 
+/* Transfer up to one page of data through the dma bounce buffer. Returns the
+   number of blocks transferred or a negative value on error. */
 static int
-nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+nvme_bounce_xfer(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
+                 int write)
 {
-    int res = DISK_RET_SUCCESS;
     u16 const max_blocks = NVME_PAGE_SIZE / ns->block_size;
-    u16 i;
+    u16 blocks = count < max_blocks ? count : max_blocks;
 
-    for (i = 0; i < op->count && res == DISK_RET_SUCCESS;) {
-        u16 blocks_remaining = op->count - i;
-        u16 blocks = blocks_remaining < max_blocks ? blocks_remaining
-                                                   : max_blocks;
-        char *op_buf = op->buf_fl + i * ns->block_size;
+    if (write)
+        memcpy(ns->dma_buffer, buf, blocks * ns->block_size);
 
-        if (write) {
-            memcpy(ns->dma_buffer, op_buf, blocks * ns->block_size);
-        }
+    int res = nvme_io_readwrite(ns, lba, ns->dma_buffer, NULL, blocks, write);
+    if (res != DISK_RET_SUCCESS)
+        return -1;
+
+    if (!write)
+        memcpy(buf, ns->dma_buffer, blocks * ns->block_size);
+
+    return blocks;
+}
+
+/* Queue a transfer directly from/to buf, describing it with PRP1/PRP2 or a
+   PRP list built in 'prpl'. Returns the number of blocks queued or a negative
+   value on error. */
+static int
+nvme_prpl_queue(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
+                u64 *prpl, int write)
+{
+    u32 base = (u32)buf;
+
+    if (count > ns->max_req_size)
+        count = ns->max_req_size;
+    u32 size = count * ns->block_size;
+    u32 first = base & NVME_PAGE_MASK;
+    u32 pages = (base + size - 1 - first) / NVME_PAGE_SIZE + 1;
+
+    void *prp2 = NULL;
+    if (pages == 2) {
+        /* Directly embed the second page */
+        prp2 = (void*)(first + NVME_PAGE_SIZE);
+    } else if (pages > 2) {
+        /* PRP1 holds the first page, the list all following pages */
+        u32 i;
+        for (i = 1; i < pages; i++)
+            prpl[i - 1] = first + i * NVME_PAGE_SIZE;
+        prp2 = prpl;
+    }
+
+    if (nvme_io_queue(ns, lba, buf, prp2, count, write))
+        return -1;
+    return count;
+}
 
-        res = nvme_io_readwrite(ns, op->lba + i, ns->dma_buffer, blocks, write);
-        dprintf(3, "ns %u %s lba %llu+%u: %d\n", ns->ns_id, write ? "write"
-                                                                  : "read",
-                op->lba + i, blocks, res);
+static int
+nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+{
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
+    u16 i;
 
-        if (!write && res == DISK_RET_SUCCESS) {
-            memcpy(op_buf, ns->dma_buffer, blocks * ns->block_size);
+    if ((u32)op->buf_fl & 0x3) {
+        /* PRP entries need dword alignment - use the bounce buffer */
+        for (i = 0; i < op->count;) {
+            int blocks = nvme_bounce_xfer(ns, op->lba + i,
+                                          op->buf_fl + i * ns->block_size,
+                                          op->count - i, write);
+            if (blocks < 0)
+                return DISK_RET_EBADTRACK;
+            i += blocks;
         }
+        return DISK_RET_SUCCESS;
+    }
+
+    /* Each command in flight gets its own PRP list page. */
+    u32 max_inflight = ns->ctrl->prpl_pages;
+    if (max_inflight > sq->common.mask)
+        max_inflight = sq->common.mask;
+
+    for (i = 0; i < op->count;) {
+        /* Queue a batch of commands, start them with a single doorbell
+           write and then reap all their completions. */
+        u32 inflight = 0;
+        while (i < op->count && inflight < max_inflight) {
+            int blocks = nvme_prpl_queue(ns, op->lba + i,
+                                         op->buf_fl + i * ns->block_size,
+                                         op->count - i,
+                                         &ns->ctrl->prpl[inflight
+                                                   * NVME_MAX_PRPL_ENTRIES],
+                                         write);
+            if (blocks < 0)
+                break;
+            i += blocks;
+            inflight++;
+        }
+        if (!inflight)
+            return DISK_RET_EBADTRACK;
 
-        i += blocks;
+        nvme_ring_sq(sq);
+        int failed = nvme_wait_batch(sq, inflight);
+        dprintf(DEBUG_HDL_13, "ns %u %s lba %llu: %u commands, %d failed\n"
+                , ns->ns_id, write ? "write" : "read", op->lba, inflight
+                , failed);
+        if (failed)
+            return DISK_RET_EBADTRACK;
     }
 
-    return res;
+    return DISK_RET_SUCCESS;
 }
 
 int
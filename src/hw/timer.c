@@ -143,7 +143,7 @@ timer_adjust_bits(u32 value, u32 validbits)
 }
 
 // Sample the current timer value.
-static u32
+u32
 timer_read(void)
 {
     u16 port = GET_GLOBAL(TimerPort);
@@ -189,6 +189,15 @@ timer_check(u32 end)
     return (s32)(timer_read() - end) > 0;
 }
 
+// Return the number of microseconds passed since 'start' (a value
+// previously returned from timer_read()).
+u32
+timer_elapsed_usec(u32 start)
+{
+    u32 ticks = timer_read() - start, khz = GET_GLOBAL(TimerKHz);
+    return (ticks / khz) * 1000 + (ticks % khz) * 1000 / khz;
+}
+
 static void
 timer_delay(u32 end)
 {
@@ -58,47 +58,103 @@ static const u32 tpm_default_durations[3] = {
 static u32 tpm_default_dur[3];
 static u32 tpm_default_to[4];
 
+/* width of data FIFO accesses (1 or 4 bytes) */
+static u8 tis_fifo_width = 1;
+
 static u32 crb_cmd_size;
 static void *crb_cmd;
 static u32 crb_resp_size;
 static void *crb_resp;
 
-static u32 wait_reg8(u8* reg, u32 time, u8 mask, u8 expect)
+/*
+ * Register accessors - they count the MMIO accesses of the current
+ * command (see tpmhw_transmit())
+ */
+u32 TPMHW_mmio_count VARLOW;
+
+static u8 tpm_readb(const void *addr)
+{
+    TPMHW_mmio_count++;
+    return readb(addr);
+}
+
+static u32 tpm_readl(const void *addr)
+{
+    TPMHW_mmio_count++;
+    return readl(addr);
+}
+
+static void tpm_writeb(void *addr, u8 val)
+{
+    TPMHW_mmio_count++;
+    writeb(addr, val);
+}
+
+static void tpm_writel(void *addr, u32 val)
+{
+    TPMHW_mmio_count++;
+    writel(addr, val);
+}
+
+/*
+ * Register polling: the first TPM_POLL_TIGHT polls only yield, after
+ * that the interval between polls doubles up to a maximum that depends
+ * on how long the awaited operation is expected to take.
+ */
+#define TPM_POLL_TIGHT 16
+
+static const u32 tpm_poll_max_delay[3] = {
+    [TPM_DURATION_TYPE_SHORT]  = 100,   /* us */
+    [TPM_DURATION_TYPE_MEDIUM] = 1000,  /* us */
+    [TPM_DURATION_TYPE_LONG]   = 10000, /* us */
+};
+
+static u32 wait_reg8(u8* reg, u32 time, u8 mask, u8 expect,
+                     enum tpmDurationType to_t)
 {
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    u32 rc = 1;
     u32 end = timer_calc_usec(time);
+    u32 max_delay = tpm_poll_max_delay[to_t];
+    u32 polls = 0, delay = 1;
 
     for (;;) {
-        u8 value = readl(reg);
-        if ((value & mask) == expect) {
-            rc = 0;
-            break;
-        }
+        u8 value = tpm_readl(reg);
+        if ((value & mask) == expect)
+            return 0;
         if (timer_check(end)) {
             warn_timeout();
-            break;
+            return 1;
         }
-        yield();
+        if (polls < TPM_POLL_TIGHT) {
+            polls++;
+            yield();
+            continue;
+        }
+        usleep(delay);
+        delay *= 2;
+        if (delay > max_delay)
+            delay = max_delay;
     }
-    return rc;
 }
 
 static u32 tis_wait_access(u8 locty, u32 time, u8 mask, u8 expect)
 {
-    return wait_reg8(TIS_REG(locty, TIS_REG_ACCESS), time, mask, expect);
+    return wait_reg8(TIS_REG(locty, TIS_REG_ACCESS), time, mask, expect,
+                     TPM_DURATION_TYPE_SHORT);
 }
 
 static u32 tis_wait_sts(u8 locty, u32 time, u8 mask, u8 expect)
 {
-    return wait_reg8(TIS_REG(locty, TIS_REG_STS), time, mask, expect);
+    return wait_reg8(TIS_REG(locty, TIS_REG_STS), time, mask, expect,
+                     TPM_DURATION_TYPE_SHORT);
 }
 
 static u32 crb_wait_reg(u8 locty, u16 reg, u32 time, u8 mask, u8 expect)
 {
-    return wait_reg8(CRB_REG(locty, reg), time, mask, expect);
+    return wait_reg8(CRB_REG(locty, reg), time, mask, expect,
+                     TPM_DURATION_TYPE_SHORT);
 }
 
 /* if device is not there, return '0', '1' otherwise */
@@ -114,13 +170,13 @@ static u32 tis_probe(void)
     if (rc)
         return 0;
 
-    u32 didvid = readl(TIS_REG(0, TIS_REG_DID_VID));
+    u32 didvid = tpm_readl(TIS_REG(0, TIS_REG_DID_VID));
 
     if ((didvid != 0) && (didvid != 0xffffffff))
         rc = 1;
 
     /* TPM 2 has an interface register */
-    u32 ifaceid = readl(TIS_REG(0, TIS_REG_IFACE_ID));
+    u32 ifaceid = tpm_readl(TIS_REG(0, TIS_REG_IFACE_ID));
 
     if ((ifaceid & 0xf) != 0xf) {
         if ((ifaceid & 0xf) == 1) {
@@ -132,9 +188,9 @@ static u32 tis_probe(void)
             return 0;
         }
         /* write of 0 to bits 17-18 selects TIS */
-        writel(TIS_REG(0, TIS_REG_IFACE_ID), 0);
+        tpm_writel(TIS_REG(0, TIS_REG_IFACE_ID), 0);
         /* since we only support TIS, we lock it */
-        writel(TIS_REG(0, TIS_REG_IFACE_ID), (1 << 19));
+        tpm_writel(TIS_REG(0, TIS_REG_IFACE_ID), (1 << 19));
     }
 
     return rc;
@@ -142,14 +198,14 @@ static u32 tis_probe(void)
 
 static TPMVersion tis_get_tpm_version(void)
 {
-    u32 reg = readl(TIS_REG(0, TIS_REG_IFACE_ID));
+    u32 reg = tpm_readl(TIS_REG(0, TIS_REG_IFACE_ID));
 
     /*
      * FIFO interface as defined in TIS1.3 is active
      * Interface capabilities are defined in TIS_REG_INTF_CAPABILITY
      */
     if ((reg & 0xf) == 0xf) {
-        reg = readl(TIS_REG(0, TIS_REG_INTF_CAPABILITY));
+        reg = tpm_readl(TIS_REG(0, TIS_REG_INTF_CAPABILITY));
         /* Interface 1.3 for TPM 2.0 */
         if (((reg >> 28) & 0x7) == 3)
             return TPM_VERSION_2;
@@ -184,7 +240,15 @@ static u32 tis_init(void)
     if (!CONFIG_TCGBIOS)
         return 1;
 
-    writeb(TIS_REG(0, TIS_REG_INT_ENABLE), 0);
+    tpm_writeb(TIS_REG(0, TIS_REG_INT_ENABLE), 0);
+
+    /* the FIFO of the PTP interfaces can be accessed with 32 bit reads
+       and writes if the TPM supports transfers larger than one byte */
+    if (tis_get_tpm_version() == TPM_VERSION_2) {
+        u32 caps = tpm_readl(TIS_REG(0, TIS_REG_INTF_CAPABILITY));
+        if (caps & TIS_CAP_DATA_TRANSFER_SIZE_MASK)
+            tis_fifo_width = 4;
+    }
 
     init_timeout(TIS_DRIVER_IDX);
 
@@ -216,20 +280,20 @@ static u32 tis_activate(u8 locty)
     int l;
     u32 timeout_a = tpm_drivers[TIS_DRIVER_IDX].timeouts[TIS_TIMEOUT_TYPE_A];
 
-    if (!(readb(TIS_REG(locty, TIS_REG_ACCESS)) &
+    if (!(tpm_readb(TIS_REG(locty, TIS_REG_ACCESS)) &
           TIS_ACCESS_ACTIVE_LOCALITY)) {
         /* release locality in use top-downwards */
         for (l = 4; l >= 0; l--)
-            writeb(TIS_REG(l, TIS_REG_ACCESS),
+            tpm_writeb(TIS_REG(l, TIS_REG_ACCESS),
                    TIS_ACCESS_ACTIVE_LOCALITY);
     }
 
     /* request access to locality */
-    writeb(TIS_REG(locty, TIS_REG_ACCESS), TIS_ACCESS_REQUEST_USE);
+    tpm_writeb(TIS_REG(locty, TIS_REG_ACCESS), TIS_ACCESS_REQUEST_USE);
 
-    acc = readb(TIS_REG(locty, TIS_REG_ACCESS));
+    acc = tpm_readb(TIS_REG(locty, TIS_REG_ACCESS));
     if ((acc & TIS_ACCESS_ACTIVE_LOCALITY)) {
-        writeb(TIS_REG(locty, TIS_REG_STS), TIS_STS_COMMAND_READY);
+        tpm_writeb(TIS_REG(locty, TIS_REG_STS), TIS_STS_COMMAND_READY);
         rc = tis_wait_sts(locty, timeout_a,
                           TIS_STS_COMMAND_READY, TIS_STS_COMMAND_READY);
     }
@@ -245,7 +309,7 @@ static u32 tis_find_active_locality(void)
     u8 locty;
 
     for (locty = 0; locty <= 4; locty++) {
-        if ((readb(TIS_REG(locty, TIS_REG_ACCESS)) &
+        if ((tpm_readb(TIS_REG(locty, TIS_REG_ACCESS)) &
              TIS_ACCESS_ACTIVE_LOCALITY))
             return locty;
     }
@@ -264,56 +328,72 @@ static u32 tis_ready(void)
     u8 locty = tis_find_active_locality();
     u32 timeout_b = tpm_drivers[TIS_DRIVER_IDX].timeouts[TIS_TIMEOUT_TYPE_B];
 
-    writeb(TIS_REG(locty, TIS_REG_STS), TIS_STS_COMMAND_READY);
+    tpm_writeb(TIS_REG(locty, TIS_REG_STS), TIS_STS_COMMAND_READY);
     rc = tis_wait_sts(locty, timeout_b,
                       TIS_STS_COMMAND_READY, TIS_STS_COMMAND_READY);
 
     return rc;
 }
 
+/* Wait for a non-zero burst count; return 0 on timeout */
+static u16 tis_wait_burst(u8 locty, u32 end)
+{
+    for (;;) {
+        u16 burst = tpm_readl(TIS_REG(locty, TIS_REG_STS)) >> 8;
+        if (burst)
+            return burst;
+        if (timer_check(end)) {
+            warn_timeout();
+            return 0;
+        }
+        yield();
+    }
+}
+
+static void tis_write_fifo(u8 locty, const u8 *data, u32 len)
+{
+    void *fifo = TIS_REG(locty, TIS_REG_DATA_FIFO);
+    if (tis_fifo_width == 4) {
+        for (; len >= 4; data += 4, len -= 4)
+            tpm_writel(fifo, *(u32*)data);
+    }
+    for (; len; data++, len--)
+        tpm_writeb(fifo, *data);
+}
+
+static void tis_read_fifo(u8 locty, u8 *buffer, u32 len)
+{
+    void *fifo = TIS_REG(locty, TIS_REG_DATA_FIFO);
+    if (tis_fifo_width == 4) {
+        for (; len >= 4; buffer += 4, len -= 4)
+            *(u32*)buffer = tpm_readl(fifo);
+    }
+    for (; len; buffer++, len--)
+        *buffer = tpm_readb(fifo);
+}
+
 static u32 tis_senddata(const u8 *const data, u32 len)
 {
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    u32 rc = 0;
     u32 offset = 0;
-    u32 end_loop = 0;
-    u16 burst = 0;
     u8 locty = tis_find_active_locality();
     u32 timeout_d = tpm_drivers[TIS_DRIVER_IDX].timeouts[TIS_TIMEOUT_TYPE_D];
     u32 end = timer_calc_usec(timeout_d);
 
-    do {
-        while (burst == 0) {
-               burst = readl(TIS_REG(locty, TIS_REG_STS)) >> 8;
-            if (burst == 0) {
-                if (timer_check(end)) {
-                    warn_timeout();
-                    break;
-                }
-                yield();
-            }
-        }
-
-        if (burst == 0) {
-            rc = TCG_RESPONSE_TIMEOUT;
-            break;
-        }
-
-        while (1) {
-            writeb(TIS_REG(locty, TIS_REG_DATA_FIFO), data[offset++]);
-            burst--;
-
-            if (burst == 0 || offset == len)
-                break;
-        }
-
-        if (offset == len)
-            end_loop = 1;
-    } while (end_loop == 0);
+    /* write the command in chunks of the size the TPM can take */
+    while (offset < len) {
+        u32 burst = tis_wait_burst(locty, end);
+        if (burst == 0)
+            return TCG_RESPONSE_TIMEOUT;
+        if (burst > len - offset)
+            burst = len - offset;
+        tis_write_fifo(locty, data + offset, burst);
+        offset += burst;
+    }
 
-    return rc;
+    return 0;
 }
 
 static u32 tis_readresp(u8 *buffer, u32 *len)
@@ -323,16 +403,21 @@ static u32 tis_readresp(u8 *buffer, u32 *len)
 
     u32 rc = 0;
     u32 offset = 0;
-    u32 sts;
     u8 locty = tis_find_active_locality();
 
+    /* read the response in chunks of the available burst count */
     while (offset < *len) {
-        buffer[offset] = readb(TIS_REG(locty, TIS_REG_DATA_FIFO));
-        offset++;
-        sts = readb(TIS_REG(locty, TIS_REG_STS));
+        u32 sts = tpm_readl(TIS_REG(locty, TIS_REG_STS));
         /* data left ? */
         if ((sts & TIS_STS_DATA_AVAILABLE) == 0)
             break;
+        u32 burst = (sts >> 8) & 0xffff;
+        if (burst == 0)
+            burst = 1;
+        if (burst > *len - offset)
+            burst = *len - offset;
+        tis_read_fifo(locty, buffer + offset, burst);
+        offset += burst;
     }
 
     *len = offset;
@@ -365,10 +450,10 @@ static u32 tis_waitrespready(enum tpmDurationType to_t)
     u8 locty = tis_find_active_locality();
     u32 timeout = tpm_drivers[TIS_DRIVER_IDX].durations[to_t];
 
-    writeb(TIS_REG(locty ,TIS_REG_STS), TIS_STS_TPM_GO);
+    tpm_writeb(TIS_REG(locty ,TIS_REG_STS), TIS_STS_TPM_GO);
 
-    if (tis_wait_sts(locty, timeout,
-                     TIS_STS_DATA_AVAILABLE, TIS_STS_DATA_AVAILABLE) != 0)
+    if (wait_reg8(TIS_REG(locty, TIS_REG_STS), timeout,
+                  TIS_STS_DATA_AVAILABLE, TIS_STS_DATA_AVAILABLE, to_t) != 0)
         rc = 1;
 
     return rc;
@@ -390,7 +475,7 @@ static u32 crb_probe(void)
     if (rc)
         return 0;
 
-    u32 ifaceid = readl(CRB_REG(0, CRB_REG_INTF_ID));
+    u32 ifaceid = tpm_readl(CRB_REG(0, CRB_REG_INTF_ID));
 
     if ((ifaceid & 0xf) != 0xf) {
         if ((ifaceid & 0xf) == 1) {
@@ -400,13 +485,13 @@ static u32 crb_probe(void)
             return 0;
         }
         /* write of 1 to bits 17-18 selects CRB */
-        writel(CRB_REG(0, CRB_REG_INTF_ID), (1 << 17));
+        tpm_writel(CRB_REG(0, CRB_REG_INTF_ID), (1 << 17));
         /* lock it */
-        writel(CRB_REG(0, CRB_REG_INTF_ID), (1 << 19));
+        tpm_writel(CRB_REG(0, CRB_REG_INTF_ID), (1 << 19));
     }
 
     /* no support for 64 bit addressing yet */
-    if (readl(CRB_REG(0, CRB_REG_CTRL_CMD_HADDR)))
+    if (tpm_readl(CRB_REG(0, CRB_REG_CTRL_CMD_HADDR)))
         return 0;
 
     u64 addr = readq(CRB_REG(0, CRB_REG_CTRL_RSP_ADDR));
@@ -427,10 +512,10 @@ static u32 crb_init(void)
     if (!CONFIG_TCGBIOS)
         return 1;
 
-    crb_cmd = (void*)readl(CRB_REG(0, CRB_REG_CTRL_CMD_LADDR));
-    crb_cmd_size = readl(CRB_REG(0, CRB_REG_CTRL_CMD_SIZE));
-    crb_resp = (void*)readl(CRB_REG(0, CRB_REG_CTRL_RSP_ADDR));
-    crb_resp_size = readl(CRB_REG(0, CRB_REG_CTRL_RSP_SIZE));
+    crb_cmd = (void*)tpm_readl(CRB_REG(0, CRB_REG_CTRL_CMD_LADDR));
+    crb_cmd_size = tpm_readl(CRB_REG(0, CRB_REG_CTRL_CMD_SIZE));
+    crb_resp = (void*)tpm_readl(CRB_REG(0, CRB_REG_CTRL_RSP_ADDR));
+    crb_resp_size = tpm_readl(CRB_REG(0, CRB_REG_CTRL_RSP_SIZE));
 
     init_timeout(CRB_DRIVER_IDX);
 
@@ -442,7 +527,7 @@ static u32 crb_activate(u8 locty)
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    writeb(CRB_REG(locty, CRB_REG_LOC_CTRL), 1);
+    tpm_writeb(CRB_REG(locty, CRB_REG_LOC_CTRL), 1);
 
     return 0;
 }
@@ -468,7 +553,7 @@ static u32 crb_ready(void)
     u8 locty = crb_find_active_locality();
     u32 timeout_c = tpm_drivers[CRB_DRIVER_IDX].timeouts[TIS_TIMEOUT_TYPE_C];
 
-    writel(CRB_REG(locty, CRB_REG_CTRL_REQ), CRB_CTRL_REQ_CMD_READY);
+    tpm_writel(CRB_REG(locty, CRB_REG_CTRL_REQ), CRB_CTRL_REQ_CMD_READY);
     rc = crb_wait_reg(locty, CRB_REG_CTRL_REQ, timeout_c,
                       CRB_CTRL_REQ_CMD_READY, 0);
 
@@ -484,8 +569,9 @@ static u32 crb_senddata(const u8 *const data, u32 len)
         return 1;
 
     u8 locty = crb_find_active_locality();
-    memcpy(crb_cmd, data, len);
-    writel(CRB_REG(locty, CRB_REG_CTRL_START), CRB_START_INVOKE);
+    if (data != crb_cmd)
+        memcpy(crb_cmd, data, len);
+    tpm_writel(CRB_REG(locty, CRB_REG_CTRL_START), CRB_START_INVOKE);
 
     return 0;
 }
@@ -496,20 +582,21 @@ static u32 crb_readresp(u8 *buffer, u32 *len)
         return 0;
 
     u8 locty = crb_find_active_locality();
-    if (readl(CRB_REG(locty, CRB_REG_CTRL_STS)) & CRB_CTRL_STS_ERROR)
+    if (tpm_readl(CRB_REG(locty, CRB_REG_CTRL_STS)) & CRB_CTRL_STS_ERROR)
         return 1;
 
     if (*len < 6)
         return 1;
 
-    memcpy(buffer, crb_resp, 6);
-    u32 expected = be32_to_cpu(*(u32 *) &buffer[2]);
+    u32 expected = be32_to_cpu(*(u32 *)(crb_resp + 2));
     if (expected < 6)
         return 1;
 
     *len = (*len < expected) ? *len : expected;
 
-    memcpy(buffer + 6, crb_resp + 6, *len - 6);
+    /* the response is parsed in place if the caller asked for that */
+    if (buffer != crb_resp)
+        memcpy(buffer, crb_resp, *len);
 
     return 0;
 }
@@ -529,8 +616,8 @@ static u32 crb_waitrespready(enum tpmDurationType to_t)
     u8 locty = crb_find_active_locality();
     u32 timeout = tpm_drivers[CRB_DRIVER_IDX].durations[to_t];
 
-    rc = crb_wait_reg(locty, CRB_REG_CTRL_START, timeout,
-                      CRB_START_INVOKE, 0);
+    rc = wait_reg8(CRB_REG(locty, CRB_REG_CTRL_START), timeout,
+                   CRB_START_INVOKE, 0, to_t);
 
     return rc;
 }
@@ -570,6 +657,70 @@ struct tpm_driver tpm_drivers[TPM_NUM_DRIVERS] = {
 
 static u8 TPMHW_driver_to_use = TPM_INVALID_DRIVER;
 
+// State of a burst of commands (see tpmhw_start_burst())
+#define TPMHW_BURST_OFF         0
+#define TPMHW_BURST_STARTED     1
+#define TPMHW_BURST_ACTIVE      2
+static u8 TPMHW_burst;
+
+/*
+ * Latency histogram of the commands sent to the TPM, per ordinal.
+ * Bucket i counts commands that took less than 100us * 10^i; the last
+ * bucket counts all slower ones.
+ */
+#define TPMHW_LAT_ORDINALS      12
+#define TPMHW_LAT_BUCKETS       6
+
+struct tpmhw_latency {
+    u32 ordinal;
+    u16 count[TPMHW_LAT_BUCKETS];
+};
+struct tpmhw_latency TPMHW_latency[TPMHW_LAT_ORDINALS] VARLOW;
+
+static void
+tpmhw_record_latency(u32 ordinal, u32 usecs)
+{
+    int i, bucket = 0;
+    u32 limit = 100;
+    while (bucket < TPMHW_LAT_BUCKETS - 1 && usecs >= limit) {
+        bucket++;
+        limit *= 10;
+    }
+    for (i = 0; i < TPMHW_LAT_ORDINALS; i++) {
+        struct tpmhw_latency *lat = &TPMHW_latency[i];
+        if (lat->ordinal != ordinal) {
+            int j, used = 0;
+            for (j = 0; j < TPMHW_LAT_BUCKETS; j++)
+                used |= lat->count[j];
+            if (used)
+                continue;
+            lat->ordinal = ordinal;
+        }
+        if (lat->count[bucket] < 0xffff)
+            lat->count[bucket]++;
+        return;
+    }
+}
+
+// Dump the command latency histogram to the debug console
+void
+tpmhw_dump_latency(void)
+{
+    if (!CONFIG_TCGBIOS || CONFIG_DEBUG_LEVEL < DEBUG_tcg)
+        return;
+    dprintf(DEBUG_tcg, "TCGBIOS: Command latency   <100us   <1ms  <10ms"
+            " <100ms    <1s   >=1s\n");
+    int i;
+    for (i = 0; i < TPMHW_LAT_ORDINALS; i++) {
+        struct tpmhw_latency *lat = &TPMHW_latency[i];
+        u16 *c = lat->count;
+        if (!(c[0] | c[1] | c[2] | c[3] | c[4] | c[5]))
+            break;
+        dprintf(DEBUG_tcg, "TCGBIOS:   0x%08x %8u %6u %6u %6u %6u %6u\n"
+                , lat->ordinal, c[0], c[1], c[2], c[3], c[4], c[5]);
+    }
+}
+
 TPMVersion
 tpmhw_probe(void)
 {
@@ -591,6 +742,37 @@ tpmhw_is_present(void)
     return TPMHW_driver_to_use != TPM_INVALID_DRIVER;
 }
 
+/*
+ * Zero-copy command interface.  With the CRB interface a command can
+ * be built directly in the command buffer and its response parsed
+ * where the TPM wrote it: pass the buffers returned here to
+ * tpmhw_transmit().  The response buffer may share memory with the
+ * command buffer, so the response must be parsed before the next
+ * command is built.  Both return NULL if the interface has no such
+ * buffer (TIS) or it is smaller than 'size'.  The command buffer may
+ * only be written while the locality is held, so it is requested here.
+ */
+void *
+tpmhw_get_cmd_buffer(u8 locty, u32 size)
+{
+    if (TPMHW_driver_to_use != CRB_DRIVER_IDX || size > crb_cmd_size)
+        return NULL;
+    if (TPMHW_burst != TPMHW_BURST_ACTIVE) {
+        struct tpm_driver *td = &tpm_drivers[TPMHW_driver_to_use];
+        if (td->activate(locty) != 0)
+            return NULL;
+    }
+    return crb_cmd;
+}
+
+void *
+tpmhw_get_resp_buffer(u32 size)
+{
+    if (TPMHW_driver_to_use != CRB_DRIVER_IDX || size > crb_resp_size)
+        return NULL;
+    return crb_resp;
+}
+
 int
 tpmhw_transmit(u8 locty, struct tpm_req_header *req,
                void *respbuffer, u32 *respbufferlen,
@@ -601,32 +783,67 @@ tpmhw_transmit(u8 locty, struct tpm_req_header *req,
 
     struct tpm_driver *td = &tpm_drivers[TPMHW_driver_to_use];
 
-    u32 irc = td->activate(locty);
-    if (irc != 0) {
-        /* tpm could not be activated */
-        return -1;
+    u32 start = timer_read();
+    TPMHW_mmio_count = 0;
+
+    // A command built in the CRB buffer already holds the locality (see
+    // tpmhw_get_cmd_buffer())
+    if (TPMHW_burst != TPMHW_BURST_ACTIVE && (void*)req != crb_cmd) {
+        u32 irc = td->activate(locty);
+        if (irc != 0) {
+            /* tpm could not be activated */
+            return -1;
+        }
     }
 
-    irc = td->senddata((void*)req, be32_to_cpu(req->totlen));
+    u32 irc = td->senddata((void*)req, be32_to_cpu(req->totlen));
     if (irc != 0)
-        return -1;
+        goto err;
 
     irc = td->waitdatavalid();
     if (irc != 0)
-        return -1;
+        goto err;
 
     irc = td->waitrespready(to_t);
     if (irc != 0)
-        return -1;
+        goto err;
 
     irc = td->readresp(respbuffer, respbufferlen);
     if (irc != 0 ||
         *respbufferlen < sizeof(struct tpm_rsp_header))
-        return -1;
+        goto err;
 
     td->ready();
 
+    u32 ordinal = be32_to_cpu(req->ordinal), usecs = timer_elapsed_usec(start);
+    tpmhw_record_latency(ordinal, usecs);
+    dprintf(DEBUG_tcg, "TCGBIOS: Command 0x%08x: %u MMIO accesses, %u us\n"
+            , ordinal, TPMHW_mmio_count, usecs);
+
+    if (TPMHW_burst == TPMHW_BURST_STARTED)
+        TPMHW_burst = TPMHW_BURST_ACTIVE;
     return 0;
+
+err:
+    if (TPMHW_burst == TPMHW_BURST_ACTIVE)
+        TPMHW_burst = TPMHW_BURST_STARTED;
+    return -1;
+}
+
+// Start a burst of commands.  The locality is activated by the first
+// command and then kept for the following commands - the TPM is put
+// back into the ready state after each response, so there is no need
+// to request the locality again.  Only used during POST.
+void
+tpmhw_start_burst(void)
+{
+    TPMHW_burst = TPMHW_BURST_STARTED;
+}
+
+void
+tpmhw_end_burst(void)
+{
+    TPMHW_burst = TPMHW_BURST_OFF;
 }
 
 void
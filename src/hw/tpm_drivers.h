@@ -18,11 +18,16 @@ typedef u8 TPMVersion;
 
 TPMVersion tpmhw_probe(void);
 int tpmhw_is_present(void);
+void *tpmhw_get_cmd_buffer(u8 locty, u32 size);
+void *tpmhw_get_resp_buffer(u32 size);
 struct tpm_req_header;
 int tpmhw_transmit(u8 locty, struct tpm_req_header *req,
                    void *respbuffer, u32 *respbufferlen,
                    enum tpmDurationType to_t);
 void tpmhw_set_timeouts(u32 timeouts[4], u32 durations[3]);
+void tpmhw_start_burst(void);
+void tpmhw_end_burst(void);
+void tpmhw_dump_latency(void);
 
 /* CRB driver */
 /* address of locality 0 (CRB) */
@@ -76,6 +81,8 @@ void tpmhw_set_timeouts(u32 timeouts[4], u32 durations[3]);
 #define TIS_STS_EXPECT                 (1 << 3) /* 0x08 */
 #define TIS_STS_RESPONSE_RETRY         (1 << 1) /* 0x02 */
 
+#define TIS_CAP_DATA_TRANSFER_SIZE_MASK (3 << 9)
+
 #define TIS_ACCESS_TPM_REG_VALID_STS   (1 << 7) /* 0x80 */
 #define TIS_ACCESS_ACTIVE_LOCALITY     (1 << 5) /* 0x20 */
 #define TIS_ACCESS_BEEN_SEIZED         (1 << 4) /* 0x10 */
@@ -502,11 +502,17 @@ ehci_reset_pipe(struct ehci_pipe *pipe)
     SET_LOWFLAT(pipe->qh.token, GET_LOWFLAT(pipe->qh.token) & QTD_TOGGLE);
 }
 
+// Wait for the last of 'count' chained tds to complete
 static int
-ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, u32 end)
+ehci_wait_tds(struct ehci_pipe *pipe, struct ehci_qtd *tds, int count, u32 end)
 {
+    struct ehci_qtd *last = &tds[count-1], *td;
     u32 status;
     for (;;) {
+        // The queue stops at the first halted td
+        for (td = tds; td < last; td++)
+            if (td->token & QTD_STS_HALT)
+                break;
         status = td->token;
         if (!(status & QTD_STS_ACTIVE))
             break;
@@ -526,7 +532,7 @@ ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, u32 end)
         yield();
     }
     if (status & QTD_STS_HALT) {
-        dprintf(1, "ehci_wait_td error - status=%x\n", status);
+        dprintf(1, "ehci_wait_tds error - status=%x\n", status);
         ehci_reset_pipe(pipe);
         return -2;
     }
@@ -541,6 +547,34 @@ ehci_fill_tdbuf(struct ehci_qtd *td, u32 dest, int transfer)
         *pos++ = dest;
 }
 
+// Setup transfer descriptors for a data transfer.  Returns the td
+// following the last one used, or NULL if 'tdsend' is reached.
+static struct ehci_qtd *
+ehci_fill_data_tds(struct ehci_qtd *td, struct ehci_qtd *tdsend, int dir
+                   , u32 toggle, u16 maxpacket, void *data, int datasize)
+{
+    u32 dest = (u32)data, dataend = dest + datasize;
+    while (dest < dataend) {
+        // Send data pids
+        if (td >= tdsend) {
+            warn_noalloc();
+            return NULL;
+        }
+        int maxtransfer = 5*PAGE_SIZE - (dest & (PAGE_SIZE-1));
+        int transfer = dataend - dest;
+        if (transfer > maxtransfer)
+            transfer = ALIGN_DOWN(maxtransfer, maxpacket);
+        td->qtd_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td+1);
+        td->alt_next = EHCI_PTR_TERM;
+        td->token = (ehci_explen(transfer) | toggle | QTD_STS_ACTIVE
+                     | (dir ? QTD_PID_IN : QTD_PID_OUT) | ehci_maxerr(3));
+        ehci_fill_tdbuf(td, dest, transfer);
+        td++;
+        dest += transfer;
+    }
+    return td;
+}
+
 #define STACKQTDS 6
 
 int
@@ -571,25 +605,10 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
         td++;
         toggle = QTD_TOGGLE;
     }
-    u32 dest = (u32)data, dataend = dest + datasize;
-    while (dest < dataend) {
-        // Send data pids
-        if (td >= &tds[STACKQTDS]) {
-            warn_noalloc();
-            return -1;
-        }
-        int maxtransfer = 5*PAGE_SIZE - (dest & (PAGE_SIZE-1));
-        int transfer = dataend - dest;
-        if (transfer > maxtransfer)
-            transfer = ALIGN_DOWN(maxtransfer, maxpacket);
-        td->qtd_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td+1);
-        td->alt_next = EHCI_PTR_TERM;
-        td->token = (ehci_explen(transfer) | toggle | QTD_STS_ACTIVE
-                     | (dir ? QTD_PID_IN : QTD_PID_OUT) | ehci_maxerr(3));
-        ehci_fill_tdbuf(td, dest, transfer);
-        td++;
-        dest += transfer;
-    }
+    td = ehci_fill_data_tds(td, &tds[STACKQTDS], dir, toggle, maxpacket
+                            , data, datasize);
+    if (!td)
+        return -1;
     if (cmd) {
         // Send status pid on control transfers
         if (td >= &tds[STACKQTDS]) {
@@ -608,13 +627,54 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     barrier();
     SET_LOWFLAT(pipe->qh.qtd_next, (u32)MAKE_FLATPTR(GET_SEG(SS), tds));
     u32 end = timer_calc(usb_xfer_time(p, datasize));
-    int i;
-    for (i=0, td=tds; i<STACKQTDS; i++, td++) {
-        int ret = ehci_wait_td(pipe, td, end);
-        if (ret)
-            return -1;
+    int ret = ehci_wait_tds(pipe, tds, td - tds, end);
+    if (ret)
+        return -1;
+
+    return 0;
+}
+
+int
+ehci_send_bulk_pair(struct usb_pipe *p, int dir, void *data, int datasize
+                    , void *data2, int datasize2)
+{
+    if (! CONFIG_USB_EHCI)
+        return -1;
+    struct ehci_pipe *pipe = container_of(p, struct ehci_pipe, pipe);
+    dprintf(7, "ehci_send_bulk_pair qh=%p dir=%d data=%p/%d data2=%p/%d\n"
+            , &pipe->qh, dir, data, datasize, data2, datasize2);
+
+    // Allocate tds on stack (with required alignment)
+    u8 tdsbuf[sizeof(struct ehci_qtd) * STACKQTDS + EHCI_QTD_ALIGN - 1];
+    struct ehci_qtd *tds = (void*)ALIGN((u32)tdsbuf, EHCI_QTD_ALIGN), *td;
+    memset(tds, 0, sizeof(*tds) * STACKQTDS);
+
+    // Setup transfer descriptors for both transfers
+    u16 maxpacket = GET_LOWFLAT(pipe->pipe.maxpacket);
+    struct ehci_qtd *td2 = ehci_fill_data_tds(
+        tds, &tds[STACKQTDS], dir, 0, maxpacket, data, datasize);
+    if (!td2)
+        return -1;
+    td = ehci_fill_data_tds(td2, &tds[STACKQTDS], dir, 0, maxpacket
+                            , data2, datasize2);
+    if (!td || td == tds)
+        return -1;
+    // A short packet ends the first transfer - continue with the second
+    if (dir && td2 != td) {
+        struct ehci_qtd *t;
+        for (t = tds; t < td2; t++)
+            t->alt_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td2);
     }
 
+    // Transfer data
+    (td-1)->qtd_next = EHCI_PTR_TERM;
+    barrier();
+    SET_LOWFLAT(pipe->qh.qtd_next, (u32)MAKE_FLATPTR(GET_SEG(SS), tds));
+    u32 end = timer_calc(usb_xfer_time(p, datasize + datasize2));
+    int ret = ehci_wait_tds(pipe, tds, td - tds, end);
+    if (ret)
+        return -1;
+
     return 0;
 }
 
@@ -12,6 +12,8 @@ struct usb_pipe *ehci_realloc_pipe(struct usbdevice_s *usbdev
                                    , struct usb_endpoint_descriptor *epdesc);
 int ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
+int ehci_send_bulk_pair(struct usb_pipe *p, int dir, void *data, int datasize
+                        , void *data2, int datasize2);
 int ehci_poll_intr(struct usb_pipe *p, void *data);
 
 
@@ -61,6 +61,32 @@ usb_msc_send(struct usbdrive_s *udrive_gf, int dir, void *buf, u32 bytes)
     return usb_send_bulk(pipe, dir, buf, bytes);
 }
 
+// Send two back-to-back transfers so the second is already queued on
+// the controller when the first completes.
+static int
+usb_msc_send_pair(struct usbdrive_s *udrive_gf, int dir, void *buf, u32 bytes
+                  , void *buf2, u32 bytes2)
+{
+    struct usb_pipe *pipe;
+    if (dir == USB_DIR_OUT)
+        pipe = GET_GLOBALFLAT(udrive_gf->bulkout);
+    else
+        pipe = GET_GLOBALFLAT(udrive_gf->bulkin);
+    return usb_send_bulk_pair(pipe, dir, buf, bytes, buf2, bytes2);
+}
+
+u32 UsbMscTag VARLOW;
+
+// Return the maximum number of blocks in a single command.
+int
+usb_msc_max_count(struct drive_s *drive_fl)
+{
+    struct usbdrive_s *udrive_gf = container_of(
+        drive_fl, struct usbdrive_s, drive);
+    u32 max = usb_xfer_max(GET_GLOBALFLAT(udrive_gf->bulkin));
+    return max / GET_GLOBALFLAT(drive_fl->blksize);
+}
+
 // Low-level usb command transmit function.
 int
 usb_process_op(struct disk_op_s *op)
@@ -80,33 +106,44 @@ usb_process_op(struct disk_op_s *op)
     if (blocksize < 0)
         return default_process_op(op);
     u32 bytes = blocksize * op->count;
+    u32 tag = GET_LOW(UsbMscTag) + 1;
+    SET_LOW(UsbMscTag, tag);
     cbw.dCBWSignature = CBW_SIGNATURE;
-    cbw.dCBWTag = 999; // XXX
+    cbw.dCBWTag = tag;
     cbw.dCBWDataTransferLength = bytes;
     cbw.bmCBWFlags = scsi_is_read(op) ? USB_DIR_IN : USB_DIR_OUT;
     cbw.bCBWLUN = GET_GLOBALFLAT(udrive_gf->lun);
     cbw.bCBWCBLength = USB_CDB_SIZE;
 
-    // Transfer cbw to device.
-    int ret = usb_msc_send(udrive_gf, USB_DIR_OUT
-                           , MAKE_FLATPTR(GET_SEG(SS), &cbw), sizeof(cbw));
-    if (ret)
-        goto fail;
-
-    // Transfer data to/from device.
-    if (bytes) {
-        ret = usb_msc_send(udrive_gf, cbw.bmCBWFlags, op->buf_fl, bytes);
+    // Transfer cbw, data and csw.  The data phase is queued together
+    // with the phase before or after it on the same endpoint.
+    struct csw_s csw;
+    void *cbw_fl = MAKE_FLATPTR(GET_SEG(SS), &cbw);
+    void *csw_fl = MAKE_FLATPTR(GET_SEG(SS), &csw);
+    int ret;
+    if (bytes && cbw.bmCBWFlags == USB_DIR_OUT) {
+        ret = usb_msc_send_pair(udrive_gf, USB_DIR_OUT, cbw_fl, sizeof(cbw)
+                                , op->buf_fl, bytes);
+        if (ret)
+            goto fail;
+        ret = usb_msc_send(udrive_gf, USB_DIR_IN, csw_fl, sizeof(csw));
+    } else {
+        ret = usb_msc_send(udrive_gf, USB_DIR_OUT, cbw_fl, sizeof(cbw));
         if (ret)
             goto fail;
+        if (bytes)
+            ret = usb_msc_send_pair(udrive_gf, USB_DIR_IN, op->buf_fl, bytes
+                                    , csw_fl, sizeof(csw));
+        else
+            ret = usb_msc_send(udrive_gf, USB_DIR_IN, csw_fl, sizeof(csw));
     }
-
-    // Transfer csw info.
-    struct csw_s csw;
-    ret = usb_msc_send(udrive_gf, USB_DIR_IN
-                       , MAKE_FLATPTR(GET_SEG(SS), &csw), sizeof(csw));
     if (ret)
         goto fail;
 
+    if (csw.dCSWSignature != CSW_SIGNATURE || csw.dCSWTag != tag)
+        // Some devices don't echo the tag - report it and carry on
+        dprintf(3, "USB MSC unexpected csw (sig=%x tag=%x/%x)\n"
+                , csw.dCSWSignature, csw.dCSWTag, tag);
     if (!csw.bCSWStatus)
         return DISK_RET_SUCCESS;
     if (csw.bCSWStatus == 2)
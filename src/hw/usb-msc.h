@@ -4,6 +4,8 @@
 // usb-msc.c
 struct disk_op_s;
 int usb_process_op(struct disk_op_s *op);
+struct drive_s;
+int usb_msc_max_count(struct drive_s *drive_fl);
 struct usbdevice_s;
 int usb_msc_setup(struct usbdevice_s *usbdev);
 
@@ -10,7 +10,7 @@
 #include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
 #include "pcidevice.h" // foreachpci
-#include "pci_ids.h" // PCI_CLASS_SERIAL_USB_XHCI
+#include "pci_ids.h" // PCI_CLASS_SERIAL_USB_XHCI, PCI_VENDOR_ID_REDHAT
 #include "pci_regs.h" // PCI_BASE_ADDRESS_0
 #include "string.h" // memcpy
 #include "usb.h" // struct usb_s
@@ -23,6 +23,7 @@
 
 #define XHCI_RING_ITEMS          16
 #define XHCI_RING_SIZE           (XHCI_RING_ITEMS*sizeof(struct xhci_trb))
+#define XHCI_TRB_MAX             (64*1024)
 
 /*
  *  xhci_ring structs are allocated with XHCI_RING_SIZE alignment,
@@ -54,6 +55,8 @@
 #define XHCI_STS_CNR             (1<<11)
 #define XHCI_STS_HCE             (1<<12)
 
+#define XHCI_ERDP_EHB            (1<<3)
+
 #define XHCI_PORTSC_CCS          (1<<0)
 #define XHCI_PORTSC_PED          (1<<1)
 #define XHCI_PORTSC_OCA          (1<<3)
@@ -241,6 +244,7 @@ struct usb_xhci_s {
     u8                   context64;
     struct xhci_portmap  usb2;
     struct xhci_portmap  usb3;
+    u32                  portevent_end;
 
     /* xhci registers */
     struct xhci_caps     *caps;
@@ -254,6 +258,11 @@ struct usb_xhci_s {
     struct xhci_ring     *cmds;
     struct xhci_ring     *evts;
     struct xhci_er_seg   *eseg;
+
+    /* statistics */
+    u32                  evtcount;
+    u32                  mmiowrites;
+    u32                  waitusec;
 };
 
 struct xhci_pipe {
@@ -313,6 +322,7 @@ static int wait_bit(u32 *reg, u32 mask, int value, u32 timeout)
  ****************************************************************/
 
 #define XHCI_TIME_POSTPOWER 20
+#define XHCI_TIME_PORTEVENT 20
 
 // Check if device attached to port
 static void
@@ -328,12 +338,95 @@ xhci_print_port_state(int loglevel, const char *prefix, u32 port, u32 portsc)
             pls, speed, speed_name[speed]);
 }
 
+// Dequeue events on the XHCI command ring generated by the hardware
+static void xhci_process_events(struct usb_xhci_s *xhci)
+{
+    struct xhci_ring *evts = xhci->evts;
+    u32 count = 0;
+
+    for (;;) {
+        /* check for event */
+        u32 nidx = evts->nidx;
+        u32 cs = evts->cs;
+        struct xhci_trb *etrb = evts->ring + nidx;
+        u32 control = etrb->control;
+        if ((control & TRB_C) != (cs ? 1 : 0))
+            break;
+
+        /* process event */
+        u32 evt_type = TRB_TYPE(control);
+        u32 evt_cc = (etrb->status >> 24) & 0xff;
+        switch (evt_type) {
+        case ER_TRANSFER:
+        case ER_COMMAND_COMPLETE:
+        {
+            struct xhci_trb  *rtrb = (void*)etrb->ptr_low;
+            struct xhci_ring *ring = XHCI_RING(rtrb);
+            struct xhci_trb  *evt = &ring->evt;
+            u32 eidx = rtrb - ring->ring + 1;
+            dprintf(5, "%s: ring %p [trb %p, evt %p, type %d, eidx %d, cc %d]\n",
+                    __func__, ring, rtrb, evt, evt_type, eidx, evt_cc);
+            memcpy(evt, etrb, sizeof(*etrb));
+            ring->eidx = eidx;
+            break;
+        }
+        case ER_PORT_STATUS_CHANGE:
+        {
+            u32 port = ((etrb->ptr_low >> 24) & 0xff) - 1;
+            // Read status, and clear port status change bits
+            u32 portsc = readl(&xhci->pr[port].portsc);
+            u32 pclear = (((portsc & ~(XHCI_PORTSC_PED|XHCI_PORTSC_PR))
+                           & ~(XHCI_PORTSC_PLS_MASK<<XHCI_PORTSC_PLS_SHIFT))
+                          | (1<<XHCI_PORTSC_PLS_SHIFT));
+            writel(&xhci->pr[port].portsc, pclear);
+            xhci->mmiowrites++;
+            if (xhci->portevent_end)
+                xhci->portevent_end = timer_calc(XHCI_TIME_PORTEVENT);
+
+            xhci_print_port_state(3, __func__, port, portsc);
+            break;
+        }
+        default:
+            dprintf(1, "%s: unknown event, type %d, cc %d\n",
+                    __func__, evt_type, evt_cc);
+            break;
+        }
+
+        /* move ring index */
+        nidx++;
+        if (nidx == XHCI_RING_ITEMS) {
+            nidx = 0;
+            cs = cs ? 0 : 1;
+            evts->cs = cs;
+        }
+        evts->nidx = nidx;
+        count++;
+    }
+    if (!count)
+        return;
+
+    /* notify xhci once for the whole batch (and clear event handler busy) */
+    struct xhci_ir *ir = xhci->ir;
+    u32 erdp = (u32)(evts->ring + evts->nidx);
+    writel(&ir->erdp_low, erdp | XHCI_ERDP_EHB);
+    writel(&ir->erdp_high, 0);
+    xhci->mmiowrites += 2;
+    xhci->evtcount += count;
+}
+
 static int
 xhci_hub_detect(struct usbhub_s *hub, u32 port)
 {
     struct usb_xhci_s *xhci = container_of(hub->cntl, struct usb_xhci_s, usb);
     u32 portsc = readl(&xhci->pr[port].portsc);
-    return (portsc & XHCI_PORTSC_CCS) ? 1 : 0;
+    if (portsc & XHCI_PORTSC_CCS)
+        return 1;
+    // Port status change events push out the deadline
+    xhci_process_events(xhci);
+    if (xhci->portevent_end && timer_check(xhci->portevent_end))
+        // No connect reported since the last port status change event
+        return -1;
+    return 0;
 }
 
 // Reset device on port
@@ -418,6 +511,16 @@ xhci_check_ports(struct usb_xhci_s *xhci)
     // Wait for port power to stabilize.
     msleep(XHCI_TIME_POSTPOWER);
 
+    // Ports of emulated controllers report a connection as soon as the
+    // controller runs, so stop waiting for the attach window once port
+    // status change events have settled.
+    struct pci_device *pci = xhci->usb.pci;
+    if ((pci->vendor == PCI_VENDOR_ID_REDHAT
+         && pci->device == PCI_DEVICE_ID_REDHAT_XHCI)
+        || (pci->vendor == PCI_VENDOR_ID_NEC
+            && pci->device == PCI_DEVICE_ID_NEC_UPD720200))
+        xhci->portevent_end = timer_calc(XHCI_TIME_PORTEVENT);
+
     struct usbhub_s hub;
     memset(&hub, 0, sizeof(hub));
     hub.cntl = &xhci->usb;
@@ -515,6 +618,9 @@ configure_xhci(void *data)
     // Find devices
     int count = xhci_check_ports(xhci);
     xhci_free_pipes(xhci);
+    dprintf(3, "XHCI %pP: %d events, %d mmio writes, %d us in event wait\n"
+            , xhci->usb.pci, xhci->evtcount, xhci->mmiowrites
+            , xhci->waitusec);
     if (count)
         // Success
         return;
@@ -648,71 +754,7 @@ static void xhci_doorbell(struct usb_xhci_s *xhci, u32 slotid, u32 value)
     struct xhci_db *db = xhci->db;
     void *addr = &db[slotid].doorbell;
     writel(addr, value);
-}
-
-// Dequeue events on the XHCI command ring generated by the hardware
-static void xhci_process_events(struct usb_xhci_s *xhci)
-{
-    struct xhci_ring *evts = xhci->evts;
-
-    for (;;) {
-        /* check for event */
-        u32 nidx = evts->nidx;
-        u32 cs = evts->cs;
-        struct xhci_trb *etrb = evts->ring + nidx;
-        u32 control = etrb->control;
-        if ((control & TRB_C) != (cs ? 1 : 0))
-            return;
-
-        /* process event */
-        u32 evt_type = TRB_TYPE(control);
-        u32 evt_cc = (etrb->status >> 24) & 0xff;
-        switch (evt_type) {
-        case ER_TRANSFER:
-        case ER_COMMAND_COMPLETE:
-        {
-            struct xhci_trb  *rtrb = (void*)etrb->ptr_low;
-            struct xhci_ring *ring = XHCI_RING(rtrb);
-            struct xhci_trb  *evt = &ring->evt;
-            u32 eidx = rtrb - ring->ring + 1;
-            dprintf(5, "%s: ring %p [trb %p, evt %p, type %d, eidx %d, cc %d]\n",
-                    __func__, ring, rtrb, evt, evt_type, eidx, evt_cc);
-            memcpy(evt, etrb, sizeof(*etrb));
-            ring->eidx = eidx;
-            break;
-        }
-        case ER_PORT_STATUS_CHANGE:
-        {
-            u32 port = ((etrb->ptr_low >> 24) & 0xff) - 1;
-            // Read status, and clear port status change bits
-            u32 portsc = readl(&xhci->pr[port].portsc);
-            u32 pclear = (((portsc & ~(XHCI_PORTSC_PED|XHCI_PORTSC_PR))
-                           & ~(XHCI_PORTSC_PLS_MASK<<XHCI_PORTSC_PLS_SHIFT))
-                          | (1<<XHCI_PORTSC_PLS_SHIFT));
-            writel(&xhci->pr[port].portsc, pclear);
-
-            xhci_print_port_state(3, __func__, port, portsc);
-            break;
-        }
-        default:
-            dprintf(1, "%s: unknown event, type %d, cc %d\n",
-                    __func__, evt_type, evt_cc);
-            break;
-        }
-
-        /* move ring index, notify xhci */
-        nidx++;
-        if (nidx == XHCI_RING_ITEMS) {
-            nidx = 0;
-            cs = cs ? 0 : 1;
-            evts->cs = cs;
-        }
-        evts->nidx = nidx;
-        struct xhci_ir *ir = xhci->ir;
-        u32 erdp = (u32)(evts->ring + nidx);
-        writel(&ir->erdp_low, erdp);
-        writel(&ir->erdp_high, 0);
-    }
+    xhci->mmiowrites++;
 }
 
 // Check if a ring has any pending TRBs
@@ -728,20 +770,26 @@ static int xhci_event_wait(struct usb_xhci_s *xhci,
                            struct xhci_ring *ring,
                            u32 timeout)
 {
-    u32 end = timer_calc(timeout);
+    u32 start = timer_read(), end = timer_calc(timeout);
+    int cc;
 
     for (;;) {
         xhci_process_events(xhci);
-        if (!xhci_ring_busy(ring)) {
-            u32 status = ring->evt.status;
-            return (status >> 24) & 0xff;
-        }
+        cc = (ring->evt.status >> 24) & 0xff;
+        if (!xhci_ring_busy(ring))
+            break;
+        if (cc != CC_INVALID && cc != CC_SUCCESS && cc != CC_SHORT_PACKET)
+            // An earlier TD failed - the endpoint halts before the rest
+            break;
         if (timer_check(end)) {
             warn_timeout();
-            return -1;
+            cc = -1;
+            break;
         }
         yield();
     }
+    xhci->waitusec += timer_elapsed_usec(start);
+    return cc;
 }
 
 // Add a TRB to the given ring
@@ -764,7 +812,9 @@ static void xhci_trb_queue(struct xhci_ring *ring,
                            void *data, u32 xferlen, u32 flags)
 {
     if (ring->nidx >= ARRAY_SIZE(ring->ring) - 1) {
-        xhci_trb_fill(ring, ring->ring, 0, (TR_LINK << 10) | TRB_LK_TC);
+        // The link TRB is part of the TD if the previous TRB is chained
+        u32 chain = ring->ring[ring->nidx - 1].control & TRB_TR_CH;
+        xhci_trb_fill(ring, ring->ring, 0, (TR_LINK << 10) | TRB_LK_TC | chain);
         ring->nidx = 0;
         ring->cs ^= 1;
         dprintf(5, "%s: ring %p [linked]\n", __func__, ring);
@@ -792,6 +842,7 @@ static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
     }
 
     mutex_lock(&xhci->cmds->lock);
+    xhci->cmds->evt.status = 0;
     xhci_trb_queue(xhci->cmds, inctx, 0, flags);
     xhci_doorbell(xhci, 0, 0);
     int rc = xhci_event_wait(xhci, xhci->cmds, 1000);
@@ -1095,7 +1146,29 @@ static void xhci_xfer_normal(struct xhci_pipe *pipe,
 {
     struct usb_xhci_s *xhci = container_of(
         pipe->pipe.cntl, struct usb_xhci_s, usb);
-    xhci_trb_queue(&pipe->reqs, data, datalen, (TR_NORMAL << 10) | TRB_TR_IOC);
+    u32 maxpacket = pipe->pipe.maxpacket;
+    u32 dest = (u32)data, dataend = dest + datalen;
+    for (;;) {
+        // A TRB buffer may not cross a 64KiB boundary
+        u32 transfer = dataend - dest;
+        u32 maxtransfer = XHCI_TRB_MAX - (dest & (XHCI_TRB_MAX - 1));
+        u32 flags = TR_NORMAL << 10;
+        if (transfer > maxtransfer) {
+            transfer = maxtransfer;
+            flags |= TRB_TR_CH;
+        } else {
+            flags |= TRB_TR_IOC;
+        }
+        // TD size - number of packets remaining after this TRB
+        u32 tdsize = DIV_ROUND_UP(dataend - dest - transfer, maxpacket);
+        if (tdsize > 31)
+            tdsize = 31;
+        xhci_trb_queue(&pipe->reqs, (void*)dest, transfer | (tdsize << 17)
+                       , flags);
+        dest += transfer;
+        if (dest >= dataend)
+            break;
+    }
     xhci_doorbell(xhci, pipe->slotid, pipe->epid);
 }
 
@@ -1109,6 +1182,7 @@ xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     struct usb_xhci_s *xhci = container_of(
         pipe->pipe.cntl, struct usb_xhci_s, usb);
 
+    pipe->reqs.evt.status = 0;
     if (cmd) {
         const struct usb_ctrlrequest *req = cmd;
         if (req->bRequest == USB_REQ_SET_ADDRESS)
@@ -1128,6 +1202,30 @@ xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     return 0;
 }
 
+int
+xhci_send_bulk_pair(struct usb_pipe *p, int dir, void *data, int datalen
+                    , void *data2, int datalen2)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+
+    pipe->reqs.evt.status = 0;
+    xhci_xfer_normal(pipe, data, datalen);
+    xhci_xfer_normal(pipe, data2, datalen2);
+
+    int cc = xhci_event_wait(xhci, &pipe->reqs
+                             , usb_xfer_time(p, datalen + datalen2));
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+        return -1;
+    }
+
+    return 0;
+}
+
 int VISIBLE32FLAT
 xhci_poll_intr(struct usb_pipe *p, void *data)
 {
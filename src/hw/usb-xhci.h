@@ -14,8 +14,13 @@ struct usb_pipe *xhci_realloc_pipe(struct usbdevice_s *usbdev
                                    , struct usb_endpoint_descriptor *epdesc);
 int xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
+int xhci_send_bulk_pair(struct usb_pipe *p, int dir, void *data, int datasize
+                        , void *data2, int datasize2);
 int xhci_poll_intr(struct usb_pipe *p, void *data);
 
+// Largest bulk transfer queued at once (chained TRBs on one ring)
+#define XHCI_MAX_XFER (512*1024)
+
 // --------------------------------------------------------------
 // register interface
 
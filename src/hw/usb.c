@@ -19,7 +19,7 @@
 #include "usb-ohci.h" // ohci_setup
 #include "usb-uas.h" // usb_uas_setup
 #include "usb-uhci.h" // uhci_setup
-#include "util.h" // msleep
+#include "util.h" // msleep, fastboot_found
 #include "x86.h" // __fls
 
 
@@ -129,6 +129,38 @@ usb_send_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
     return usb_send_pipe(pipe_fl, dir, NULL, data, datasize);
 }
 
+// Send two consecutive transfers to a bulk endpoint.  Controllers that
+// support it queue both at once, so the second transfer starts as soon
+// as the first one completes.
+int
+usb_send_bulk_pair(struct usb_pipe *pipe_fl, int dir, void *data, int datasize
+                   , void *data2, int datasize2)
+{
+    switch (GET_LOWFLAT(pipe_fl->type)) {
+    case USB_TYPE_EHCI:
+        return ehci_send_bulk_pair(pipe_fl, dir, data, datasize
+                                   , data2, datasize2);
+    case USB_TYPE_XHCI:
+        if (MODESEGMENT)
+            return -1;
+        return xhci_send_bulk_pair(pipe_fl, dir, data, datasize
+                                   , data2, datasize2);
+    }
+    int ret = usb_send_bulk(pipe_fl, dir, data, datasize);
+    if (ret)
+        return ret;
+    return usb_send_bulk(pipe_fl, dir, data2, datasize2);
+}
+
+// Return the largest bulk transfer a pipe's controller can queue at once.
+int
+usb_xfer_max(struct usb_pipe *pipe_fl)
+{
+    if (CONFIG_USB_XHCI && GET_LOWFLAT(pipe_fl->type) == USB_TYPE_XHCI)
+        return XHCI_MAX_XFER;
+    return 64*1024;
+}
+
 // Check if a pipe for a given controller is on the freelist
 int
 usb_is_freelist(struct usb_s *cntl, struct usb_pipe *pipe)
@@ -374,6 +406,9 @@ configure_usb_device(struct usbdevice_s *usbdev)
         && iface->bInterfaceClass != USB_CLASS_HUB)
         // Not a supported device.
         goto fail;
+    if (iface->bInterfaceClass == USB_CLASS_MASS_STORAGE && fastboot_found())
+        // Fast boot already found the boot device - only keep input devices.
+        goto fail;
 
     // Set the configuration.
     ret = set_configuration(usbdev->defpipe, config->bConfigurationValue);
@@ -231,6 +231,9 @@ struct usb_endpoint_descriptor {
 
 // usb.c
 int usb_send_bulk(struct usb_pipe *pipe, int dir, void *data, int datasize);
+int usb_send_bulk_pair(struct usb_pipe *pipe_fl, int dir, void *data
+                       , int datasize, void *data2, int datasize2);
+int usb_xfer_max(struct usb_pipe *pipe_fl);
 int usb_poll_intr(struct usb_pipe *pipe, void *data);
 int usb_32bit_pipe(struct usb_pipe *pipe_fl);
 struct usb_pipe *usb_alloc_pipe(struct usbdevice_s *usbdev
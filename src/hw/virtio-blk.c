@@ -7,7 +7,7 @@
 //
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
-#include "biosvar.h" // GET_GLOBALFLAT
+#include "biosvar.h" // GET_LOWFLAT
 #include "config.h" // CONFIG_*
 #include "block.h" // struct drive_s
 #include "malloc.h" // free
@@ -18,7 +18,7 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep
+#include "util.h" // boot_add_hd
 #include "virtio-pci.h"
 #include "virtio-ring.h"
 #include "virtio-blk.h"
@@ -27,55 +27,108 @@ struct virtiodrive_s {
     struct drive_s drive;
     struct vring_virtqueue *vq;
     struct vp_device vp;
+    u32 max_req_blocks;
+    /* I/O ports used when driving the queue from 16bit mode */
+    u16 notify_port, isr_port;
 };
 
+/* Maximum number of requests put on the ring with a single kick. */
+#define VIRTIO_BLK_MAX_BATCH 8
+
+// Make new requests visible to the device and notify it if needed.
+static void
+virtio_blk_kick(struct virtiodrive_s *vdrive_gf, struct vring_virtqueue *vq
+                , int num)
+{
+    if (!MODESEGMENT) {
+        vring_kick(&vdrive_gf->vp, vq, num);
+        return;
+    }
+    if (vring_publish(vq, num))
+        outw(GET_LOWFLAT(vq->queue_index), GET_LOWFLAT(vdrive_gf->notify_port));
+}
+
+static void
+virtio_blk_clear_isr(struct virtiodrive_s *vdrive_gf)
+{
+    if (!MODESEGMENT) {
+        vp_get_isr(&vdrive_gf->vp);
+        return;
+    }
+    u16 isr_port = GET_LOWFLAT(vdrive_gf->isr_port);
+    if (isr_port)
+        inb(isr_port);
+}
+
 static int
 virtio_blk_op(struct disk_op_s *op, int write)
 {
-    struct virtiodrive_s *vdrive =
+    struct virtiodrive_s *vdrive_gf =
         container_of(op->drive_fl, struct virtiodrive_s, drive);
-    struct vring_virtqueue *vq = vdrive->vq;
-    struct virtio_blk_outhdr hdr = {
-        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-        .ioprio = 0,
-        .sector = op->lba,
-    };
-    u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr       = (void*)(&hdr),
-            .length     = sizeof(hdr),
-        },
-        {
-            .addr       = op->buf_fl,
-            .length     = vdrive->drive.blksize * op->count,
-        },
-        {
-            .addr       = (void*)(&status),
-            .length     = sizeof(status),
-        },
-    };
-
-    /* Add to virtqueue and kick host */
-    if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
-    else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
-    vring_kick(&vdrive->vp, vq, 1);
-
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
-
-    /* Reclaim virtqueue element */
-    vring_get_buf(vq, NULL);
-
-    /* Clear interrupt status register.  Avoid leaving interrupts stuck if
-     * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
-     */
-    vp_get_isr(&vdrive->vp);
-
-    return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    struct vring_virtqueue *vq = GET_LOWFLAT(vdrive_gf->vq);
+    struct virtio_blk_outhdr hdr[VIRTIO_BLK_MAX_BATCH];
+    u8 status[VIRTIO_BLK_MAX_BATCH];
+    u32 max_blocks = GET_LOWFLAT(vdrive_gf->max_req_blocks), done = 0;
+    u32 blksize = GET_LOWFLAT(vdrive_gf->drive.blksize);
+    int num_slots = GET_LOWFLAT(vq->vring.num);
+    int batch = (!MODESEGMENT && vq->indirect) ? num_slots : num_slots / 3;
+    if (batch > VIRTIO_BLK_MAX_BATCH)
+        batch = VIRTIO_BLK_MAX_BATCH;
+
+    while (done < op->count) {
+        /* Add a batch of requests to the virtqueue */
+        int i, num;
+        for (num = 0; num < batch && done < op->count; num++) {
+            u32 count = op->count - done;
+            if (max_blocks && count > max_blocks)
+                count = max_blocks;
+            hdr[num] = (struct virtio_blk_outhdr) {
+                .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                .ioprio = 0,
+                .sector = op->lba + done,
+            };
+            status[num] = VIRTIO_BLK_S_UNSUPP;
+            struct vring_list sg[] = {
+                {
+                    .addr       = MAKE_FLATPTR(GET_SEG(SS), &hdr[num]),
+                    .length     = sizeof(hdr[num]),
+                },
+                {
+                    .addr       = op->buf_fl + done * blksize,
+                    .length     = blksize * count,
+                },
+                {
+                    .addr       = MAKE_FLATPTR(GET_SEG(SS), &status[num]),
+                    .length     = sizeof(status[num]),
+                },
+            };
+            if (write)
+                vring_add_buf(vq, sg, 2, 1, num, num);
+            else
+                vring_add_buf(vq, sg, 1, 2, num, num);
+            done += count;
+        }
+
+        /* Kick host once for the whole batch */
+        virtio_blk_kick(vdrive_gf, vq, num);
+
+        /* Wait for replies and reclaim virtqueue elements */
+        for (i = 0; i < num; i++) {
+            vring_wait_used(vq);
+            vring_get_buf(vq, NULL);
+        }
+
+        /* Clear interrupt status register.  Avoid leaving interrupts stuck if
+         * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
+         */
+        virtio_blk_clear_isr(vdrive_gf);
+
+        for (i = 0; i < num; i++)
+            if (status[i] != VIRTIO_BLK_S_OK)
+                return DISK_RET_EBADTRACK;
+    }
+
+    return DISK_RET_SUCCESS;
 }
 
 int
@@ -93,6 +146,9 @@ virtio_blk_process_op(struct disk_op_s *op)
     }
 }
 
+// Number of disks with a queue in low memory.
+static int VirtioBlkLowmem;
+
 static void
 init_virtio_blk(void *data)
 {
@@ -105,27 +161,61 @@ init_virtio_blk(void *data)
         return;
     }
     memset(vdrive, 0, sizeof(*vdrive));
-    vdrive->drive.type = DTYPE_VIRTIO_BLK;
+    vdrive->drive.type = DTYPE_VIRTIO_BLK_32;
     vdrive->drive.cntl_id = pci->bdf;
 
-    vp_init_simple(&vdrive->vp, pci);
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
+    /* The queue can be driven from 16bit mode (without a call32 per
+     * request) if it is in low memory and notifications use port I/O.
+     * Low memory is scarce, so only do this for a limited number of
+     * disks (plus the boot disk). */
+    struct vp_device *vp = &vdrive->vp;
+    vp_init_simple(vp, pci);
+    int prio = bootprio_find_pci_device(pci);
+    int lowmem = (CONFIG_VIRTIO_BLK_LOWMEM_DISKS
+                  && (VirtioBlkLowmem < CONFIG_VIRTIO_BLK_LOWMEM_DISKS
+                      || prio == 1)
+                  && (!vp->use_modern || vp->notify.mode == VP_ACCESS_IO));
+    if (lowmem)
+        VirtioBlkLowmem++;
+    if (vp_find_vq(vp, 0, &vdrive->vq, lowmem) < 0 ) {
         dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
         goto fail;
     }
+    if (lowmem && (u32)vdrive->vq < BUILD_BIOS_ADDR) {
+        if (vp->use_modern) {
+            vdrive->notify_port = vp->notify.ioaddr
+                + vdrive->vq->queue_notify_off * vp->notify_off_multiplier;
+            if (vp->isr.mode == VP_ACCESS_IO)
+                vdrive->isr_port = vp->isr.ioaddr;
+        } else {
+            vdrive->notify_port = vp->legacy.ioaddr
+                + offsetof(struct virtio_pci_legacy, queue_notify);
+            vdrive->isr_port = vp->legacy.ioaddr
+                + offsetof(struct virtio_pci_legacy, isr);
+        }
+        vdrive->drive.type = DTYPE_VIRTIO_BLK;
+    }
 
-    if (vdrive->vp.use_modern) {
-        struct vp_device *vp = &vdrive->vp;
+    /* Indirect descriptors only help if the ring can't hold a full batch
+     * of direct (three descriptor) requests. */
+    u64 indirect = 0;
+    if (vdrive->vq->vring.num / 3 < VIRTIO_BLK_MAX_BATCH)
+        indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
+
+    if (vp->use_modern) {
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
         u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
+        u64 size_max = 1ull << VIRTIO_BLK_F_SIZE_MAX;
+        u64 event_idx = 1ull << VIRTIO_RING_F_EVENT_IDX;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        features = features & (version1 | iommu_platform | blk_size);
+        features = features & (version1 | iommu_platform | blk_size
+                               | size_max | event_idx | indirect);
         vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
@@ -156,6 +246,13 @@ init_virtio_blk(void *data)
             vp_read(&vp->device, struct virtio_blk_config, heads);
         vdrive->drive.pchs.sector =
             vp_read(&vp->device, struct virtio_blk_config, sectors);
+
+        vdrive->vq->event_idx = !!(features & event_idx);
+        if (features & indirect)
+            vring_alloc_indirect(vdrive->vq, VIRTIO_BLK_MAX_BATCH);
+        if (features & size_max)
+            vdrive->max_req_blocks = vp_read(&vp->device,
+                struct virtio_blk_config, size_max) / DISK_SECTOR_SIZE;
     } else {
         struct virtio_blk_config cfg;
         vp_get_legacy(&vdrive->vp, 0, &cfg, sizeof(cfg));
@@ -176,10 +273,19 @@ init_virtio_blk(void *data)
         vdrive->drive.pchs.cylinder = cfg.cylinders;
         vdrive->drive.pchs.head = cfg.heads;
         vdrive->drive.pchs.sector = cfg.sectors;
+
+        f &= (1 << VIRTIO_BLK_F_SIZE_MAX) | (1 << VIRTIO_RING_F_EVENT_IDX)
+            | indirect;
+        vp_set_features(&vdrive->vp, f);
+        vdrive->vq->event_idx = !!(f & (1 << VIRTIO_RING_F_EVENT_IDX));
+        if (f & indirect)
+            vring_alloc_indirect(vdrive->vq, VIRTIO_BLK_MAX_BATCH);
+        if (f & (1 << VIRTIO_BLK_F_SIZE_MAX))
+            vdrive->max_req_blocks = cfg.size_max / DISK_SECTOR_SIZE;
     }
 
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk PCI:%pP", pci);
-    boot_add_hd(&vdrive->drive, desc, bootprio_find_pci_device(pci));
+    boot_add_hd(&vdrive->drive, desc, prio);
 
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(&vdrive->vp, status);
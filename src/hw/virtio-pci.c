@@ -290,13 +290,20 @@ void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq)
     }
 }
 
+/* With 'lowmem' the queue is placed in low memory if there is room, so
+ * that it can also be used from 16bit mode. */
 int vp_find_vq(struct vp_device *vp, int queue_index,
-               struct vring_virtqueue **p_vq)
+               struct vring_virtqueue **p_vq, int lowmem)
 {
    u16 num;
 
    ASSERT32FLAT();
-   struct vring_virtqueue *vq = *p_vq = memalign_high(PAGE_SIZE, sizeof(*vq));
+   struct vring_virtqueue *vq = NULL;
+   if (lowmem)
+       vq = memalign_low(PAGE_SIZE, sizeof(*vq));
+   if (!vq)
+       vq = memalign_high(PAGE_SIZE, sizeof(*vq));
+   *p_vq = vq;
    if (!vq) {
        warn_noalloc();
        goto fail;
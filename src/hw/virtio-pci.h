@@ -147,5 +147,5 @@ struct vring_virtqueue;
 void vp_init_simple(struct vp_device *vp, struct pci_device *pci);
 void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq);
 int vp_find_vq(struct vp_device *vp, int queue_index,
-               struct vring_virtqueue **p_vq);
+               struct vring_virtqueue **p_vq, int lowmem);
 #endif /* _VIRTIO_PCI_H_ */
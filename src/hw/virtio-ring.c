@@ -16,7 +16,10 @@
  *
  */
 
+#include "malloc.h" // memalign_high
 #include "output.h" // panic
+#include "stacks.h" // yield
+#include "string.h" // memset
 #include "virtio-ring.h"
 #include "virtio-pci.h"
 
@@ -30,17 +33,78 @@
  *
  * is there some used buffers ?
  *
+ * The ring code below may run in 16bit mode, in which case the virtqueue
+ * must have been allocated in low memory (see vp_find_vq()).
  */
 
 int vring_more_used(struct vring_virtqueue *vq)
 {
-    struct vring_used *used = vq->vring.used;
-    int more = vq->last_used_idx != used->idx;
+    struct vring_used *used = GET_LOWFLAT(vq->vring.used);
+    int more = GET_LOWFLAT(vq->last_used_idx) != GET_LOWFLAT(used->idx);
     /* Make sure ring reads are done after idx read above. */
     smp_rmb();
     return more;
 }
 
+/*
+ * vring_wait_used
+ *
+ * wait for the next used buffer
+ *
+ * The used index lives in guest memory, so it is polled without leaving
+ * the guest for a while before falling back to yield().  The spin budget
+ * grows while requests complete near the end of it and shrinks when the
+ * device needs longer than that.
+ */
+
+#define VRING_POLL_MIN 16
+#define VRING_POLL_MAX 4096
+
+void vring_wait_used(struct vring_virtqueue *vq)
+{
+    u32 spin = GET_LOWFLAT(vq->poll_spin), i;
+    if (spin < VRING_POLL_MIN)
+        spin = VRING_POLL_MIN;
+
+    for (i = 0; i < spin; i++) {
+        if (vring_more_used(vq)) {
+            if (i >= spin / 2 && spin < VRING_POLL_MAX)
+                spin *= 2;
+            SET_LOWFLAT(vq->poll_spin, spin);
+            return;
+        }
+        cpu_relax();
+    }
+    SET_LOWFLAT(vq->poll_spin, spin / 2);
+
+    while (!vring_more_used(vq))
+        yield();
+}
+
+/*
+ * vring_alloc_indirect
+ *
+ * allocate 'count' indirect descriptor tables, so that a buffer list
+ * only occupies a single descriptor in the ring.  The tables are
+ * indexed by the 'index' passed to vring_add_buf().
+ *
+ */
+
+int vring_alloc_indirect(struct vring_virtqueue *vq, int count)
+{
+    ASSERT32FLAT();
+    u32 size = count * VRING_INDIRECT_MAX * sizeof(struct vring_desc);
+    struct vring_desc *indirect = memalign_high(sizeof(*indirect), size);
+    if (!indirect) {
+        warn_noalloc();
+        return -1;
+    }
+    memset(indirect, 0, size);
+    vq->indirect = indirect;
+    vq->indirect_num = count;
+    return 0;
+}
+
 /*
  * vring_free
  *
@@ -56,13 +120,13 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
     /* find end of given descriptor */
 
     i = head;
-    while (desc[i].flags & VRING_DESC_F_NEXT)
-        i = desc[i].next;
+    while (GET_LOWFLAT(desc[i].flags) & VRING_DESC_F_NEXT)
+        i = GET_LOWFLAT(desc[i].next);
 
     /* link it with free list and point to it */
 
-    desc[i].next = vq->free_head;
-    vq->free_head = head;
+    SET_LOWFLAT(desc[i].next, GET_LOWFLAT(vq->free_head));
+    SET_LOWFLAT(vq->free_head, head);
 }
 
 /*
@@ -76,22 +140,29 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 {
     struct vring *vr = &vq->vring;
     struct vring_used_elem *elem;
-    struct vring_used *used = vq->vring.used;
+    struct vring_used *used = GET_LOWFLAT(vr->used);
+    u16 last_used_idx = GET_LOWFLAT(vq->last_used_idx);
     u32 id;
     int ret;
 
 //    BUG_ON(!vring_more_used(vq));
 
-    elem = &used->ring[vq->last_used_idx % vr->num];
-    id = elem->id;
+    elem = &used->ring[last_used_idx % GET_LOWFLAT(vr->num)];
+    id = GET_LOWFLAT(elem->id);
     if (len != NULL)
-        *len = elem->len;
+        *len = GET_LOWFLAT(elem->len);
 
-    ret = vq->vdata[id];
+    ret = GET_LOWFLAT(vq->vdata[id]);
 
     vring_detach(vq, id);
 
-    vq->last_used_idx = vq->last_used_idx + 1;
+    last_used_idx++;
+    SET_LOWFLAT(vq->last_used_idx, last_used_idx);
+    /* Keep the interrupt threshold behind the used index. */
+    if (GET_LOWFLAT(vq->event_idx))
+        SET_LOWFLAT(vring_used_event(GET_LOWFLAT(vr->avail)
+                                     , GET_LOWFLAT(vr->num))
+                    , (u16)(last_used_idx - 1));
 
     return ret;
 }
@@ -103,45 +174,91 @@ void vring_add_buf(struct vring_virtqueue *vq,
 {
     struct vring *vr = &vq->vring;
     int i, av, head, prev;
-    struct vring_desc *desc = vr->desc;
-    struct vring_avail *avail = vr->avail;
+    struct vring_desc *desc = GET_LOWFLAT(vr->desc);
+    struct vring_avail *avail = GET_LOWFLAT(vr->avail);
+    struct vring_desc *indirect = GET_LOWFLAT(vq->indirect);
 
     BUG_ON(out + in == 0);
 
-    prev = 0;
-    head = vq->free_head;
-    for (i = head; out; i = desc[i].next, out--) {
-        desc[i].flags = VRING_DESC_F_NEXT;
-        desc[i].addr = (u64)virt_to_phys(list->addr);
-        desc[i].len = list->length;
-        prev = i;
-        list++;
-    }
-    for ( ; in; i = desc[i].next, in--) {
-        desc[i].flags = VRING_DESC_F_NEXT|VRING_DESC_F_WRITE;
-        desc[i].addr = (u64)virt_to_phys(list->addr);
-        desc[i].len = list->length;
-        prev = i;
-        list++;
-    }
-    desc[prev].flags = desc[prev].flags & ~VRING_DESC_F_NEXT;
+    head = GET_LOWFLAT(vq->free_head);
+    if (!MODESEGMENT && indirect && out + in <= VRING_INDIRECT_MAX
+        && index < vq->indirect_num) {
+        /* Put the list in the table of this buffer */
+        struct vring_desc *table = &indirect[index * VRING_INDIRECT_MAX];
+        for (i = 0; i < out + in; i++) {
+            table[i].flags = VRING_DESC_F_NEXT;
+            if (i >= out)
+                table[i].flags |= VRING_DESC_F_WRITE;
+            table[i].addr = (u64)virt_to_phys(list[i].addr);
+            table[i].len = list[i].length;
+            table[i].next = i + 1;
+        }
+        table[i - 1].flags &= ~VRING_DESC_F_NEXT;
 
-    vq->free_head = i;
+        desc[head].flags = VRING_DESC_F_INDIRECT;
+        desc[head].addr = (u64)virt_to_phys(table);
+        desc[head].len = (out + in) * sizeof(*table);
+        vq->free_head = desc[head].next;
+    } else {
+        prev = 0;
+        for (i = head; out; i = GET_LOWFLAT(desc[i].next), out--) {
+            SET_LOWFLAT(desc[i].flags, VRING_DESC_F_NEXT);
+            SET_LOWFLAT(desc[i].addr, (u64)virt_to_phys(list->addr));
+            SET_LOWFLAT(desc[i].len, list->length);
+            prev = i;
+            list++;
+        }
+        for ( ; in; i = GET_LOWFLAT(desc[i].next), in--) {
+            SET_LOWFLAT(desc[i].flags, VRING_DESC_F_NEXT|VRING_DESC_F_WRITE);
+            SET_LOWFLAT(desc[i].addr, (u64)virt_to_phys(list->addr));
+            SET_LOWFLAT(desc[i].len, list->length);
+            prev = i;
+            list++;
+        }
+        SET_LOWFLAT(desc[prev].flags,
+                    GET_LOWFLAT(desc[prev].flags) & ~VRING_DESC_F_NEXT);
 
-    vq->vdata[head] = index;
+        SET_LOWFLAT(vq->free_head, i);
+    }
+
+    SET_LOWFLAT(vq->vdata[head], index);
 
-    av = (avail->idx + num_added) % vr->num;
-    avail->ring[av] = head;
+    av = (GET_LOWFLAT(avail->idx) + num_added) % GET_LOWFLAT(vr->num);
+    SET_LOWFLAT(avail->ring[av], head);
 }
 
-void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
+/*
+ * vring_publish
+ *
+ * make num_added buffers visible to the device and return whether the
+ * device has to be notified about them
+ *
+ */
+
+int vring_publish(struct vring_virtqueue *vq, int num_added)
 {
     struct vring *vr = &vq->vring;
-    struct vring_avail *avail = vr->avail;
+    struct vring_avail *avail = GET_LOWFLAT(vr->avail);
+    struct vring_used *used = GET_LOWFLAT(vr->used);
+    u16 old_idx = GET_LOWFLAT(avail->idx), new_idx = old_idx + num_added;
 
     /* Make sure idx update is done after ring write. */
     smp_wmb();
-    avail->idx = avail->idx + num_added;
+    SET_LOWFLAT(avail->idx, new_idx);
 
-    vp_notify(vp, vq);
+    /* Skip the notification (a VM exit) if the device is still busy with
+     * earlier buffers and will pick up the new ones on its own. */
+    smp_mb();
+    if (GET_LOWFLAT(vq->event_idx)) {
+        u16 event = GET_LOWFLAT(vring_avail_event(used, GET_LOWFLAT(vr->num)));
+        return vring_need_event(event, new_idx, old_idx);
+    }
+    return !(GET_LOWFLAT(used->flags) & VRING_USED_F_NO_NOTIFY);
+}
+
+void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
+{
+    ASSERT32FLAT();
+    if (vring_publish(vq, num_added))
+        vp_notify(vp, vq);
 }
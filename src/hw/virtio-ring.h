@@ -20,10 +20,19 @@
 #define VIRTIO_F_VERSION_1              32
 #define VIRTIO_F_IOMMU_PLATFORM         33
 
+/* Descriptors may point to a table of further descriptors. */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+/* The rings carry used_event/avail_event notification thresholds. */
+#define VIRTIO_RING_F_EVENT_IDX         29
+
 #define MAX_QUEUE_NUM      (256)
 
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
+
+/* Maximum number of buffers in one indirect descriptor table. */
+#define VRING_INDIRECT_MAX 4
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
@@ -66,8 +75,21 @@ struct vring {
 
 #define vring_size(num) \
     (ALIGN(sizeof(struct vring_desc) * num + sizeof(struct vring_avail) \
-           + sizeof(u16) * num, PAGE_SIZE)                              \
-     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num)
+           + sizeof(u16) * (num + 1), PAGE_SIZE)                        \
+     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num \
+     + sizeof(u16))
+
+/* Only used with VIRTIO_RING_F_EVENT_IDX: the driver asks for an interrupt
+ * once the used index passes used_event, the device wants a notification
+ * once the avail index passes avail_event. */
+#define vring_used_event(avail, num) ((avail)->ring[num])
+#define vring_avail_event(used, num) (*(u16 *)&(used)->ring[num])
+
+static inline int
+vring_need_event(u16 event_idx, u16 new_idx, u16 old_idx)
+{
+    return (u16)(new_idx - event_idx - 1) < (u16)(new_idx - old_idx);
+}
 
 typedef unsigned char virtio_queue_t[vring_size(MAX_QUEUE_NUM)];
 
@@ -76,6 +98,10 @@ struct vring_virtqueue {
    struct vring vring;
    u16 free_head;
    u16 last_used_idx;
+   u16 poll_spin;
+   u8 event_idx;
+   struct vring_desc *indirect;
+   u16 indirect_num;
    u16 vdata[MAX_QUEUE_NUM];
    /* PCI */
    int queue_index;
@@ -99,9 +125,10 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
    vr->avail = (struct vring_avail *)&vr->desc[num];
    /* disable interrupts */
    vr->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+   vring_used_event(vr->avail, num) = 0xffff;
 
    /* physical address of used must be page aligned */
-   vr->used = (void*)ALIGN((u32)&vr->avail->ring[num], PAGE_SIZE);
+   vr->used = (void*)ALIGN((u32)&vr->avail->ring[num + 1], PAGE_SIZE);
 
    int i;
    for (i = 0; i < num - 1; i++)
@@ -111,11 +138,14 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
 
 struct vp_device;
 int vring_more_used(struct vring_virtqueue *vq);
+void vring_wait_used(struct vring_virtqueue *vq);
+int vring_alloc_indirect(struct vring_virtqueue *vq, int count);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len);
 void vring_add_buf(struct vring_virtqueue *vq, struct vring_list list[],
                    unsigned int out, unsigned int in,
                    int index, int num_added);
+int vring_publish(struct vring_virtqueue *vq, int num_added);
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added);
 
 #endif /* _VIRTIO_RING_H_ */
@@ -18,7 +18,7 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep
+#include "util.h" // bootprio_find_scsi_device
 #include "virtio-pci.h"
 #include "virtio-ring.h"
 #include "virtio-scsi.h"
@@ -76,8 +76,7 @@ virtio_scsi_process_op(struct disk_op_s *op)
     vring_kick(vp, vq, 1);
 
     /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
+    vring_wait_used(vq);
 
     /* Reclaim virtqueue element */
     vring_get_buf(vq, NULL);
@@ -179,7 +178,7 @@ init_virtio_scsi(void *data)
         }
     }
 
-    if (vp_find_vq(vp, 2, &vq) < 0 ) {
+    if (vp_find_vq(vp, 2, &vq, 0) < 0 ) {
         dprintf(1, "fail to find vq for virtio-scsi %pP\n", pci);
         goto fail;
     }
@@ -135,11 +135,14 @@ init_optionrom(struct rom_header *rom, u16 bdf, int isvga)
     if (newrom != rom)
         memmove(newrom, rom, rom->size * 512);
 
-    tpm_option_rom(newrom, rom->size * 512);
-
-    if (isvga || get_pnp_rom(newrom))
+    if (isvga || get_pnp_rom(newrom)) {
         // Only init vga and PnP roms here.
+        tpm_option_rom(newrom, rom->size * 512);
         callrom(newrom, bdf);
+    } else {
+        // Legacy roms are run as BCVs after tpm_prepboot()
+        tpm_option_rom_lazy(newrom, rom->size * 512);
+    }
 
     return rom_confirm(newrom->size * 512);
 }
@@ -376,7 +379,7 @@ optionrom_setup(void)
     foreachpci(pci) {
         if (pci->class == PCI_CLASS_DISPLAY_VGA ||
             pci->class == PCI_CLASS_DISPLAY_OTHER ||
-            pci->have_driver)
+            pci->have_driver || fastboot_found())
             continue;
         init_pcirom(pci, 0, sources);
     }
@@ -6,7 +6,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "biosvar.h" // SET_BDA
-#include "block.h" // block_setup
+#include "block.h" // block_setup, block_cache_prepboot
 #include "bregs.h" // struct bregs
 #include "config.h" // CONFIG_*
 #include "e820map.h" // e820_add
@@ -126,12 +126,29 @@ interface_init(void)
 void
 device_hardware_setup(void)
 {
-    usb_setup();
+    // In fast boot mode probe the class holding the first boot device
+    // up front, and skip the rest if that device was found.
+    int fast = fastboot_target();
+    if (fast == FASTBOOT_USB)
+        usb_setup();
+    else if (fast == FASTBOOT_BLOCK)
+        block_setup();
+    if (fast)
+        wait_threads();
+    int skip = fastboot_found();
+    if (skip)
+        dprintf(1, "fast boot: first boot device found - skipping probes\n");
+
+    // USB is still probed for keyboards; mass storage is skipped there.
+    if (fast != FASTBOOT_USB)
+        usb_setup();
     ps2port_setup();
-    block_setup();
+    if (fast != FASTBOOT_BLOCK && !skip)
+        block_setup();
     lpt_setup();
     serial_setup();
-    cbfs_payload_setup();
+    if (!skip)
+        cbfs_payload_setup();
 }
 
 static void
@@ -168,6 +185,7 @@ prepareboot(void)
 
     // Finalize data structures before boot
     cdrom_prepboot();
+    block_cache_prepboot();
     pmm_prepboot();
     malloc_prepboot();
     e820_prepboot();
@@ -11,6 +11,64 @@
 #include "string.h" // memcmp
 
 static struct romfile_s *RomfileRoot VARVERIFY32INIT;
+static u32 RomfileCount;
+
+// Open addressed hash of file names (for exact lookups) and an index of
+// the files sorted by name (to find the files matching a prefix).  Both
+// are built from RomfileRoot; if either can't be allocated the list is
+// searched.
+static struct romfile_s **RomfileHash VARVERIFY32INIT;
+static u32 RomfileHashSize;
+static struct romfile_index_s {
+    struct romfile_s *file;
+    u32 order; // position in RomfileRoot list
+} *RomfileSorted VARVERIFY32INIT;
+
+static u32
+romfile_hash(const char *name)
+{
+    u32 hash = 0;
+    while (*name)
+        hash = hash * 31 + *name++;
+    return hash;
+}
+
+// Add a file to the hash.  If 'replace' is set it hides an earlier file
+// with the same name, otherwise the earlier file is kept.
+static void
+romfile_hash_add(struct romfile_s *file, int replace)
+{
+    u32 mask = RomfileHashSize - 1, pos = romfile_hash(file->name) & mask;
+    while (RomfileHash[pos]) {
+        if (strcmp(RomfileHash[pos]->name, file->name) == 0) {
+            if (replace)
+                RomfileHash[pos] = file;
+            return;
+        }
+        pos = (pos + 1) & mask;
+    }
+    RomfileHash[pos] = file;
+}
+
+// Rebuild the hash with room for at least twice the number of files.
+static void
+romfile_hash_grow(void)
+{
+    u32 size = RomfileHashSize ? RomfileHashSize * 2 : 64;
+    while (size < RomfileCount * 2)
+        size *= 2;
+    free(RomfileHash);
+    RomfileHashSize = 0;
+    RomfileHash = malloc_tmp(size * sizeof(RomfileHash[0]));
+    if (!RomfileHash)
+        return;
+    memset(RomfileHash, 0, size * sizeof(RomfileHash[0]));
+    RomfileHashSize = size;
+    // The list is newest first - don't let older files hide newer ones
+    struct romfile_s *cur;
+    for (cur = RomfileRoot; cur; cur = cur->next)
+        romfile_hash_add(cur, 0);
+}
 
 void
 romfile_add(struct romfile_s *file)
@@ -18,6 +76,56 @@ romfile_add(struct romfile_s *file)
     dprintf(3, "Add romfile: %s (size=%d)\n", file->name, file->size);
     file->next = RomfileRoot;
     RomfileRoot = file;
+    RomfileCount++;
+
+    free(RomfileSorted);
+    RomfileSorted = NULL;
+    if (RomfileCount * 2 > RomfileHashSize)
+        romfile_hash_grow();
+    else
+        romfile_hash_add(file, 1);
+}
+
+// Build the sorted index (shell sort by name).
+static void
+romfile_sort(void)
+{
+    RomfileSorted = malloc_tmp(RomfileCount * sizeof(RomfileSorted[0]));
+    if (!RomfileSorted)
+        return;
+    struct romfile_s *cur;
+    int count = 0, gap, i, j;
+    for (cur = RomfileRoot; cur; cur = cur->next, count++) {
+        RomfileSorted[count].file = cur;
+        RomfileSorted[count].order = count;
+    }
+    for (gap = count / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < count; i++) {
+            struct romfile_index_s tmp = RomfileSorted[i];
+            for (j = i; j >= gap; j -= gap) {
+                if (strcmp(RomfileSorted[j - gap].file->name
+                           , tmp.file->name) <= 0)
+                    break;
+                RomfileSorted[j] = RomfileSorted[j - gap];
+            }
+            RomfileSorted[j] = tmp;
+        }
+    }
+}
+
+// Return the position of the first sorted file not less than 'name'.
+static int
+romfile_sorted_pos(const char *name)
+{
+    int lo = 0, hi = RomfileCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(RomfileSorted[mid].file->name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
 // Search for the specified file.
@@ -38,13 +146,46 @@ __romfile_findprefix(const char *prefix, int prefixlen, struct romfile_s *prev)
 struct romfile_s *
 romfile_findprefix(const char *prefix, struct romfile_s *prev)
 {
-    return __romfile_findprefix(prefix, strlen(prefix), prev);
+    int prefixlen = strlen(prefix);
+    if (!RomfileSorted && RomfileCount)
+        romfile_sort();
+    if (!RomfileSorted)
+        return __romfile_findprefix(prefix, prefixlen, prev);
+
+    // Files matching a prefix are adjacent in the sorted index.  Return
+    // them in list order (newest first) - the order of the search above.
+    u32 prevorder = 0, pos;
+    if (prev) {
+        for (pos = romfile_sorted_pos(prev->name); pos < RomfileCount; pos++)
+            if (RomfileSorted[pos].file == prev)
+                break;
+        if (pos >= RomfileCount)
+            return NULL;
+        prevorder = RomfileSorted[pos].order + 1;
+    }
+    struct romfile_index_s *best = NULL;
+    for (pos = romfile_sorted_pos(prefix); pos < RomfileCount; pos++) {
+        struct romfile_index_s *ri = &RomfileSorted[pos];
+        if (memcmp(prefix, ri->file->name, prefixlen) != 0)
+            break;
+        if (ri->order >= prevorder && (!best || ri->order < best->order))
+            best = ri;
+    }
+    return best ? best->file : NULL;
 }
 
 struct romfile_s *
 romfile_find(const char *name)
 {
-    return __romfile_findprefix(name, strlen(name) + 1, NULL);
+    if (!RomfileHashSize)
+        return __romfile_findprefix(name, strlen(name) + 1, NULL);
+    u32 mask = RomfileHashSize - 1, pos = romfile_hash(name) & mask;
+    while (RomfileHash[pos]) {
+        if (strcmp(RomfileHash[pos]->name, name) == 0)
+            return RomfileHash[pos];
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
 }
 
 // Helper function to find, malloc_tmphigh, and copy a romfile.  This
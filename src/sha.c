@@ -0,0 +1,157 @@
+// Multi-algorithm SHA hashing engine
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "config.h" // CONFIG_TCGBIOS
+#include "byteorder.h" // cpu_to_be64
+#include "sha.h" // sha_multi
+#include "string.h" // memcpy
+
+// Start the final block of a message in 'buf' from the last 'num'
+// bytes (less than one block) of the message at 'tail'.  Returns
+// non-zero if there is no room left for the message length - in that
+// case the caller must hash 'buf' and zero it before calling
+// sha_pad_length().
+int
+sha_pad(u8 *buf, u32 blocksize, const u8 *tail, u32 num)
+{
+    memcpy(buf, tail, num);
+    buf[num] = 0x80;
+    memset(&buf[num + 1], 0, blocksize - num - 1);
+
+    // The message bit length occupies the last 8 bytes of a 64 byte
+    // block and the last 16 bytes of a 128 byte block.
+    return num + 1 > blocksize - blocksize / 8;
+}
+
+// Store the bit length of a 'length' byte message at the end of 'buf'
+void
+sha_pad_length(u8 *buf, u32 blocksize, u64 length)
+{
+    u64 bits = cpu_to_be64(length << 3);
+    memcpy(&buf[blocksize - sizeof(bits)], &bits, sizeof(bits));
+}
+
+// Start a new hash of a message with every algorithm in 'algs'
+// (SHA_ALG_* flags).  The message may then be fed in arbitrarily
+// sized pieces with sha_update().
+void
+sha_init(struct sha_ctx *ctx, u8 algs)
+{
+    ctx->algs = algs & (SHA_ALG_SHA1 | SHA_ALG_SHA256
+                        | SHA_ALG_SHA384 | SHA_ALG_SHA512);
+    ctx->buflen = 0;
+    ctx->length = 0;
+    if (ctx->algs & SHA_ALG_SHA1)
+        sha1_init(&ctx->sha1);
+    if (ctx->algs & SHA_ALG_SHA256)
+        sha256_init(&ctx->sha256);
+    if (ctx->algs & SHA_ALG_SHA384)
+        sha384_init(&ctx->sha384);
+    if (ctx->algs & SHA_ALG_SHA512)
+        sha512_init(&ctx->sha512);
+}
+
+// Feed the chunk in ctx->buf to all the requested block functions
+static void
+sha_chunk(struct sha_ctx *ctx)
+{
+    u32 i;
+    for (i = 0; i < sizeof(ctx->buf); i += SHA1_BLOCK_SIZE) {
+        if (ctx->algs & SHA_ALG_SHA1)
+            sha1_block(&ctx->sha1, &ctx->buf[i]);
+        if (ctx->algs & SHA_ALG_SHA256)
+            sha256_block(&ctx->sha256, &ctx->buf[i]);
+    }
+    if (ctx->algs & SHA_ALG_SHA384)
+        sha512_block(&ctx->sha384, ctx->buf);
+    if (ctx->algs & SHA_ALG_SHA512)
+        sha512_block(&ctx->sha512, ctx->buf);
+}
+
+// Add 'len' bytes at 'data' to the message.  Each chunk of the input
+// is read once and then fed to all the requested block functions.
+void
+sha_update(struct sha_ctx *ctx, const void *data, u32 len)
+{
+    if (!CONFIG_TCGBIOS)
+        return;
+
+    ctx->length += len;
+    while (len) {
+        u32 n = sizeof(ctx->buf) - ctx->buflen;
+        if (n > len)
+            n = len;
+        memcpy(&ctx->buf[ctx->buflen], data, n);
+        ctx->buflen += n;
+        data += n;
+        len -= n;
+        if (ctx->buflen < sizeof(ctx->buf))
+            break;
+        sha_chunk(ctx);
+        ctx->buflen = 0;
+    }
+}
+
+// Finish the message and store the digests in 'd'
+void
+sha_final(struct sha_ctx *ctx, struct sha_digests *d)
+{
+    d->algs = 0;
+    if (!CONFIG_TCGBIOS)
+        return;
+
+    // Remaining data is less than one sha384/sha512 block but may
+    // still hold a full sha1/sha256 block.
+    u32 num = ctx->buflen;
+    u32 small = num >= SHA1_BLOCK_SIZE ? SHA1_BLOCK_SIZE : 0;
+    if (ctx->algs & SHA_ALG_SHA1) {
+        if (small)
+            sha1_block(&ctx->sha1, ctx->buf);
+        sha1_final(&ctx->sha1, &ctx->buf[small], num - small, ctx->length
+                   , d->sha1);
+    }
+    if (ctx->algs & SHA_ALG_SHA256) {
+        if (small)
+            sha256_block(&ctx->sha256, ctx->buf);
+        sha256_final(&ctx->sha256, &ctx->buf[small], num - small
+                     , ctx->length, d->sha256);
+    }
+    if (ctx->algs & SHA_ALG_SHA384)
+        sha384_final(&ctx->sha384, ctx->buf, num, ctx->length, d->sha384);
+    if (ctx->algs & SHA_ALG_SHA512)
+        sha512_final(&ctx->sha512, ctx->buf, num, ctx->length, d->sha512);
+
+    d->algs = ctx->algs;
+}
+
+// Hash 'data' with every algorithm in 'algs' (SHA_ALG_* flags) in a
+// single pass over the buffer.
+void
+sha_multi(u8 algs, const u8 *data, u32 length, struct sha_digests *d)
+{
+    struct sha_ctx ctx;
+    sha_init(&ctx, algs);
+    sha_update(&ctx, data, length);
+    sha_final(&ctx, d);
+}
+
+// Return the digest for 'alg' in 'd', or NULL if it was not computed.
+u8 *
+sha_digest(struct sha_digests *d, u8 alg)
+{
+    if (!(d->algs & alg))
+        return NULL;
+    switch (alg) {
+    case SHA_ALG_SHA1:
+        return d->sha1;
+    case SHA_ALG_SHA256:
+        return d->sha256;
+    case SHA_ALG_SHA384:
+        return d->sha384;
+    case SHA_ALG_SHA512:
+        return d->sha512;
+    }
+    return NULL;
+}
+
@@ -0,0 +1,87 @@
+#ifndef __SHA_H
+#define __SHA_H
+
+#include "types.h" // u32
+
+#define SHA1_DIGEST_SIZE        20
+#define SHA256_DIGEST_SIZE      32
+#define SHA384_DIGEST_SIZE      48
+#define SHA512_DIGEST_SIZE      64
+
+#define SHA1_BLOCK_SIZE         64
+#define SHA256_BLOCK_SIZE       64
+#define SHA512_BLOCK_SIZE       128
+
+// Algorithm selection flags for sha_init() and sha_multi()
+#define SHA_ALG_SHA1            (1 << 0)
+#define SHA_ALG_SHA256          (1 << 1)
+#define SHA_ALG_SHA384          (1 << 2)
+#define SHA_ALG_SHA512          (1 << 3)
+
+struct sha1_ctx {
+    u32 h[5];
+};
+
+struct sha256_ctx {
+    u32 h[8];
+};
+
+struct sha512_ctx {
+    u64 h[8];
+};
+
+// Incremental hash of a message with several algorithms at once
+struct sha_ctx {
+    u8 algs;
+    u32 buflen;
+    u64 length;
+    u8 buf[SHA512_BLOCK_SIZE];
+    struct sha1_ctx sha1;
+    struct sha256_ctx sha256;
+    struct sha512_ctx sha384, sha512;
+};
+
+// Result of sha_final() - 'algs' notes which digests are valid
+struct sha_digests {
+    u8 algs;
+    u8 sha1[SHA1_DIGEST_SIZE];
+    u8 sha256[SHA256_DIGEST_SIZE];
+    u8 sha384[SHA384_DIGEST_SIZE];
+    u8 sha512[SHA512_DIGEST_SIZE];
+};
+
+// sha.c
+int sha_pad(u8 *buf, u32 blocksize, const u8 *tail, u32 num);
+void sha_pad_length(u8 *buf, u32 blocksize, u64 length);
+void sha_init(struct sha_ctx *ctx, u8 algs);
+void sha_update(struct sha_ctx *ctx, const void *data, u32 len);
+void sha_final(struct sha_ctx *ctx, struct sha_digests *d);
+void sha_multi(u8 algs, const u8 *data, u32 length, struct sha_digests *d);
+u8 *sha_digest(struct sha_digests *d, u8 alg);
+
+// sha1.c
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_block(struct sha1_ctx *ctx, const u8 *data);
+void sha1_final(struct sha1_ctx *ctx, const u8 *tail, u32 num, u64 length
+                , u8 *hash);
+u32 sha1(const u8 *data, u32 length, u8 *hash);
+
+// sha256.c
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_block(struct sha256_ctx *ctx, const u8 *data);
+void sha256_final(struct sha256_ctx *ctx, const u8 *tail, u32 num, u64 length
+                  , u8 *hash);
+u32 sha256(const u8 *data, u32 length, u8 *hash);
+
+// sha512.c
+void sha384_init(struct sha512_ctx *ctx);
+void sha512_init(struct sha512_ctx *ctx);
+void sha512_block(struct sha512_ctx *ctx, const u8 *data);
+void sha384_final(struct sha512_ctx *ctx, const u8 *tail, u32 num, u64 length
+                  , u8 *hash);
+void sha512_final(struct sha512_ctx *ctx, const u8 *tail, u32 num, u64 length
+                  , u8 *hash);
+u32 sha384(const u8 *data, u32 length, u8 *hash);
+u32 sha512(const u8 *data, u32 length, u8 *hash);
+
+#endif // sha.h
@@ -12,18 +12,13 @@
 //
 
 #include "config.h"
-#include "byteorder.h" // cpu_to_*, __swab64
-#include "sha1.h" // sha1
+#include "byteorder.h" // cpu_to_*
+#include "sha.h" // sha1
 #include "string.h" // memcpy
 #include "x86.h" // rol
 
-typedef struct _sha1_ctx {
-    u32 h[5];
-} sha1_ctx;
-
-
 static void
-sha1_block(u32 *w, sha1_ctx *ctx)
+sha1_compress(u32 *w, struct sha1_ctx *ctx)
 {
     u32 i;
     u32 a,b,c,d,e,f;
@@ -83,46 +78,117 @@ sha1_block(u32 *w, sha1_ctx *ctx)
 }
 
 
+void
+sha1_init(struct sha1_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xc3d2e1f0;
+}
+
+
+/****************************************************************
+ * Unrolled block function
+ ****************************************************************/
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// Round functions in branch-free form
+#define F_CH(b, c, d)     ((d) ^ ((b) & ((c) ^ (d))))
+#define F_PARITY(b, c, d) ((b) ^ (c) ^ (d))
+#define F_MAJ(b, c, d)    (((b) & (c)) | ((d) & ((b) | (c))))
+
+// Message schedule word 'i' - kept in a rolling 16 word window
+#define W(i) ((i) < 16 ? w[(i)] :                                       \
+              (w[(i) & 15] = ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15]  \
+                                 ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1)))
+
+// One round; the caller rotates the variable names instead of moving
+// the values between registers.
+#define R(a, b, c, d, e, f, k, i) do {                  \
+        e += ROL(a, 5) + f(b, c, d) + (k) + W(i);       \
+        b = ROL(b, 30);                                 \
+    } while (0)
+
+#define R5(f, k, i) do {                        \
+        R(a, b, c, d, e, f, k, (i));            \
+        R(e, a, b, c, d, f, k, (i) + 1);        \
+        R(d, e, a, b, c, f, k, (i) + 2);        \
+        R(c, d, e, a, b, f, k, (i) + 3);        \
+        R(b, c, d, e, a, f, k, (i) + 4);        \
+    } while (0)
+
+#define R20(f, k, i) do {                       \
+        R5(f, k, (i));                          \
+        R5(f, k, (i) + 5);                      \
+        R5(f, k, (i) + 10);                     \
+        R5(f, k, (i) + 15);                     \
+    } while (0)
+
 static void
-sha1_do(sha1_ctx *ctx, const u8 *data32, u32 length)
+sha1_block_unrolled(struct sha1_ctx *ctx, const u8 *data)
 {
-    u32 offset;
-    u16 num;
-    u32 bits = 0;
-    u32 w[80];
-    u64 tmp;
+    u32 w[16];
+    int i;
 
-    /* treat data in 64-byte chunks */
-    for (offset = 0; length - offset >= 64; offset += 64) {
-        memcpy(w, data32 + offset, 64);
-        sha1_block((u32 *)w, ctx);
-        bits += (64 * 8);
-    }
+    memcpy(w, data, SHA1_BLOCK_SIZE);
+    for (i = 0; i < 16; i++)
+        w[i] = be32_to_cpu(w[i]);
 
-    /* last block with less than 64 bytes */
-    num = length - offset;
-    bits += (num << 3);
+    u32 a = ctx->h[0];
+    u32 b = ctx->h[1];
+    u32 c = ctx->h[2];
+    u32 d = ctx->h[3];
+    u32 e = ctx->h[4];
 
-    memcpy(w, data32 + offset, num);
-    ((u8 *)w)[num] = 0x80;
-    if (64 - (num + 1) > 0)
-        memset( &((u8 *)w)[num + 1], 0x0, 64 - (num + 1));
+    R20(F_CH, 0x5a827999, 0);
+    R20(F_PARITY, 0x6ed9eba1, 20);
+    R20(F_MAJ, 0x8f1bbcdc, 40);
+    R20(F_PARITY, 0xca62c1d6, 60);
 
-    if (num >= 56) {
-        /* cannot append number of bits here */
-        sha1_block((u32 *)w, ctx);
-        memset(w, 0x0, 60);
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+}
+
+void
+sha1_block(struct sha1_ctx *ctx, const u8 *data)
+{
+    if (CONFIG_SHA1_UNROLLED) {
+        sha1_block_unrolled(ctx, data);
+        return;
     }
 
-    /* write number of bits to end of block */
-    tmp = __swab64(bits);
-    memcpy(&w[14], &tmp, 8);
+    u32 w[80];
 
-    sha1_block(w, ctx);
+    memcpy(w, data, SHA1_BLOCK_SIZE);
+    sha1_compress(w, ctx);
+}
+
+// Hash the last 'num' (less than a block) bytes of a 'length' byte
+// message and store the resulting digest in 'hash'.
+void
+sha1_final(struct sha1_ctx *ctx, const u8 *tail, u32 num, u64 length
+           , u8 *hash)
+{
+    u8 buf[SHA1_BLOCK_SIZE];
+    int i;
+
+    if (sha_pad(buf, sizeof(buf), tail, num)) {
+        sha1_block(ctx, buf);
+        memset(buf, 0, sizeof(buf));
+    }
+    sha_pad_length(buf, sizeof(buf), length);
+    sha1_block(ctx, buf);
 
     /* need to switch result's endianness */
-    for (num = 0; num < 5; num++)
-        ctx->h[num] = cpu_to_be32(ctx->h[num]);
+    for (i = 0; i < 5; i++)
+        ctx->h[i] = cpu_to_be32(ctx->h[i]);
+    memcpy(hash, ctx->h, SHA1_DIGEST_SIZE);
 }
 
 
@@ -132,16 +198,14 @@ sha1(const u8 *data, u32 length, u8 *hash)
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    sha1_ctx ctx = {
-        .h[0] = 0x67452301,
-        .h[1] = 0xefcdab89,
-        .h[2] = 0x98badcfe,
-        .h[3] = 0x10325476,
-        .h[4] = 0xc3d2e1f0,
-    };
+    struct sha1_ctx ctx;
+    u32 offset;
 
-    sha1_do(&ctx, data, length);
-    memcpy(hash, &ctx.h[0], 20);
+    sha1_init(&ctx);
+    for (offset = 0; length - offset >= SHA1_BLOCK_SIZE;
+         offset += SHA1_BLOCK_SIZE)
+        sha1_block(&ctx, data + offset);
+    sha1_final(&ctx, data + offset, length - offset, length, hash);
 
     return 0;
 }
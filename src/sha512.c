@@ -0,0 +1,212 @@
+//  Support for Calculation of SHA384 and SHA512 in SW
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+//
+//  See: FIPS 180-4 (Secure Hash Standard), sections 6.4 and 6.5
+//
+
+#include "config.h"
+#include "byteorder.h" // cpu_to_*
+#include "sha.h" // sha512
+#include "string.h" // memcpy
+
+static inline u64
+ror64(u64 val, int n)
+{
+    return (val >> n) | (val << (64 - n));
+}
+
+static const u64 sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+    0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+    0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+    0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+    0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+    0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+    0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+    0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+    0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+    0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+    0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+    0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+    0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+    0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+void
+sha384_init(struct sha512_ctx *ctx)
+{
+    ctx->h[0] = 0xcbbb9d5dc1059ed8ULL;
+    ctx->h[1] = 0x629a292a367cd507ULL;
+    ctx->h[2] = 0x9159015a3070dd17ULL;
+    ctx->h[3] = 0x152fecd8f70e5939ULL;
+    ctx->h[4] = 0x67332667ffc00b31ULL;
+    ctx->h[5] = 0x8eb44a8768581511ULL;
+    ctx->h[6] = 0xdb0c2e0d64f98fa7ULL;
+    ctx->h[7] = 0x47b5481dbefa4fa4ULL;
+}
+
+void
+sha512_init(struct sha512_ctx *ctx)
+{
+    ctx->h[0] = 0x6a09e667f3bcc908ULL;
+    ctx->h[1] = 0xbb67ae8584caa73bULL;
+    ctx->h[2] = 0x3c6ef372fe94f82bULL;
+    ctx->h[3] = 0xa54ff53a5f1d36f1ULL;
+    ctx->h[4] = 0x510e527fade682d1ULL;
+    ctx->h[5] = 0x9b05688c2b3e6c1fULL;
+    ctx->h[6] = 0x1f83d9abfb41bd6bULL;
+    ctx->h[7] = 0x5be0cd19137e2179ULL;
+}
+
+void
+sha512_block(struct sha512_ctx *ctx, const u8 *data)
+{
+    u64 w[16];
+    u64 a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    memcpy(w, data, SHA512_BLOCK_SIZE);
+    for (i = 0; i < 16; i++)
+        w[i] = be64_to_cpu(w[i]);
+
+    a = ctx->h[0];
+    b = ctx->h[1];
+    c = ctx->h[2];
+    d = ctx->h[3];
+    e = ctx->h[4];
+    f = ctx->h[5];
+    g = ctx->h[6];
+    h = ctx->h[7];
+
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            /* message schedule kept in a rolling 16 word window */
+            u64 w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+            w[i & 15] += (ror64(w15, 1) ^ ror64(w15, 8) ^ (w15 >> 7))
+                         + w[(i - 7) & 15]
+                         + (ror64(w2, 19) ^ ror64(w2, 61) ^ (w2 >> 6));
+        }
+        t1 = h + (ror64(e, 14) ^ ror64(e, 18) ^ ror64(e, 41))
+             + ((e & f) ^ (~e & g)) + sha512_k[i] + w[i & 15];
+        t2 = (ror64(a, 28) ^ ror64(a, 34) ^ ror64(a, 39))
+             + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+    ctx->h[5] += f;
+    ctx->h[6] += g;
+    ctx->h[7] += h;
+}
+
+static void
+sha512_do_final(struct sha512_ctx *ctx, const u8 *tail, u32 num, u64 length
+                , u8 *hash, u32 hashlen)
+{
+    u8 buf[SHA512_BLOCK_SIZE];
+    int i;
+
+    if (sha_pad(buf, sizeof(buf), tail, num)) {
+        sha512_block(ctx, buf);
+        memset(buf, 0, sizeof(buf));
+    }
+    sha_pad_length(buf, sizeof(buf), length);
+    sha512_block(ctx, buf);
+
+    for (i = 0; i < 8; i++)
+        ctx->h[i] = cpu_to_be64(ctx->h[i]);
+    memcpy(hash, ctx->h, hashlen);
+}
+
+// Hash the last 'num' (less than a block) bytes of a 'length' byte
+// message and store the resulting digest in 'hash'.
+void
+sha384_final(struct sha512_ctx *ctx, const u8 *tail, u32 num, u64 length
+             , u8 *hash)
+{
+    sha512_do_final(ctx, tail, num, length, hash, SHA384_DIGEST_SIZE);
+}
+
+void
+sha512_final(struct sha512_ctx *ctx, const u8 *tail, u32 num, u64 length
+             , u8 *hash)
+{
+    sha512_do_final(ctx, tail, num, length, hash, SHA512_DIGEST_SIZE);
+}
+
+static void
+sha512_do(struct sha512_ctx *ctx, const u8 *data, u32 length
+          , u8 *hash, u32 hashlen)
+{
+    u32 offset;
+
+    for (offset = 0; length - offset >= SHA512_BLOCK_SIZE;
+         offset += SHA512_BLOCK_SIZE)
+        sha512_block(ctx, data + offset);
+    sha512_do_final(ctx, data + offset, length - offset, length
+                    , hash, hashlen);
+}
+
+u32
+sha384(const u8 *data, u32 length, u8 *hash)
+{
+    if (!CONFIG_TCGBIOS)
+        return 0;
+
+    struct sha512_ctx ctx;
+    sha384_init(&ctx);
+    sha512_do(&ctx, data, length, hash, SHA384_DIGEST_SIZE);
+
+    return 0;
+}
+
+u32
+sha512(const u8 *data, u32 length, u8 *hash)
+{
+    if (!CONFIG_TCGBIOS)
+        return 0;
+
+    struct sha512_ctx ctx;
+    sha512_init(&ctx);
+    sha512_do(&ctx, data, length, hash, SHA512_DIGEST_SIZE);
+
+    return 0;
+}
@@ -32,6 +32,8 @@ struct int13ext_s {
     u16 count;
     struct segoff_s data;
     u64 lba;
+    // EDD 3.0: used if size >= 0x18 and data is 0xffff:0xffff
+    u64 data64;
 } PACKED;
 
 // DPTE definition
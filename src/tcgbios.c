@@ -16,7 +16,7 @@
 #include "fw/paravirt.h" // runningOnXen
 #include "hw/tpm_drivers.h" // tpm_drivers[]
 #include "output.h" // dprintf
-#include "sha1.h" // sha1
+#include "sha.h" // sha_multi
 #include "std/acpi.h"  // RSDP_SIGNATURE, rsdt_descriptor
 #include "std/smbios.h" // struct smbios_entry_point
 #include "std/tcg.h" // TCG_PC_LOGOVERFLOW
@@ -48,6 +48,17 @@ struct {
     u8 *          log_area_last_entry;
 } tpm_state VARLOW;
 
+// Free log space kept available for the next measurements (room for
+// 16 entries with digests of all banks and a short event)
+#define TPM_LOG_HEADROOM (16 * (sizeof(struct tpm_log_header) + 256))
+
+/* ACPI table describing the log area - it is updated when the log
+   has to be moved to a larger area during POST */
+static struct acpi_table_header *tpm_log_acpi;
+static u32 *tpm_log_acpi_laml;
+static u64 *tpm_log_acpi_lasa;
+static u32 tpm_log_moves;
+
 static int tpm_set_log_area(u8 *log_area_start_address,
                             u32 log_area_minimum_length)
 {
@@ -74,8 +85,15 @@ tpm_tcpa_probe(void)
             (u8 *)(long)tcpa->log_area_start_address,
             tcpa->log_area_minimum_length);
 
-    return tpm_set_log_area((u8*)(long)tcpa->log_area_start_address,
-                            tcpa->log_area_minimum_length);
+    int ret = tpm_set_log_area((u8*)(long)tcpa->log_area_start_address,
+                               tcpa->log_area_minimum_length);
+    if (ret)
+        return ret;
+
+    tpm_log_acpi = (void*)tcpa;
+    tpm_log_acpi_laml = &tcpa->log_area_minimum_length;
+    tpm_log_acpi_lasa = &tcpa->log_area_start_address;
+    return 0;
 }
 
 static int
@@ -92,8 +110,124 @@ tpm_tpm2_probe(void)
             (u8 *)(long)tpm2->log_area_start_address,
             tpm2->log_area_minimum_length);
 
-    return tpm_set_log_area((u8*)(long)tpm2->log_area_start_address,
-                            tpm2->log_area_minimum_length);
+    int ret = tpm_set_log_area((u8*)(long)tpm2->log_area_start_address,
+                               tpm2->log_area_minimum_length);
+    if (ret)
+        return ret;
+
+    tpm_log_acpi = (void*)tpm2;
+    tpm_log_acpi_laml = &tpm2->log_area_minimum_length;
+    tpm_log_acpi_lasa = &tpm2->log_area_start_address;
+    return 0;
+}
+
+/*
+ * Make sure there are at least 'needed' free bytes in the log.  If
+ * not, the log is moved to a larger area in high memory and the ACPI
+ * table is pointed at it.  Only possible during POST - measurements
+ * made at runtime use the headroom left by tpm_prepboot().
+ */
+static void
+tpm_log_make_room(u32 needed)
+{
+    u8 *start = tpm_state.log_area_start_address;
+    if (!tpm_log_acpi || !tpm_state.log_area_next_entry)
+        return;
+    u32 used = tpm_state.log_area_next_entry - start;
+    if (used + needed <= tpm_state.log_area_minimum_length)
+        return;
+
+    u32 size = tpm_state.log_area_minimum_length * 2;
+    while (size < used + needed)
+        size *= 2;
+    u8 *area = malloc_high(size);
+    if (!area) {
+        warn_noalloc();
+        return;
+    }
+    memcpy(area, start, used);
+    memset(area + used, 0, size - used);
+    if (tpm_log_moves)
+        // The previous area was allocated here as well
+        free(start);
+
+    if (tpm_state.log_area_last_entry)
+        tpm_state.log_area_last_entry =
+            area + (tpm_state.log_area_last_entry - start);
+    tpm_state.log_area_start_address = area;
+    tpm_state.log_area_next_entry = area + used;
+    tpm_state.log_area_minimum_length = size;
+    tpm_log_moves++;
+
+    *tpm_log_acpi_laml = size;
+    *tpm_log_acpi_lasa = (u32)area;
+    tpm_log_acpi->checksum -= checksum(tpm_log_acpi, tpm_log_acpi->length);
+
+    dprintf(DEBUG_tcg, "TCGBIOS: Log moved: LASA = %p, LAML = %u\n"
+            , area, size);
+}
+
+/*
+ * Reserve 'size' bytes at the end of the log.  The entry is built in
+ * place and then added with tpm_log_commit().
+ * Returns NULL if the log is full.
+ */
+static void *
+tpm_log_reserve(u32 size)
+{
+    dprintf(DEBUG_tcg, "TCGBIOS: LASA = %p, next entry = %p\n",
+            tpm_state.log_area_start_address, tpm_state.log_area_next_entry);
+
+    if (tpm_state.log_area_next_entry == NULL)
+        return NULL;
+
+    u32 logsize = (tpm_state.log_area_next_entry + size
+                   - tpm_state.log_area_start_address);
+    if (logsize > tpm_state.log_area_minimum_length) {
+        dprintf(DEBUG_tcg, "TCGBIOS: LOG OVERFLOW: size = %d\n", size);
+        return NULL;
+    }
+
+    return tpm_state.log_area_next_entry;
+}
+
+static void
+tpm_log_commit(u32 size)
+{
+    tpm_state.log_area_last_entry = tpm_state.log_area_next_entry;
+    tpm_state.log_area_next_entry += size;
+    tpm_state.entry_count++;
+}
+
+// Position in the log, kept as offsets as the log may be moved
+struct tpm_log_pos {
+    u32 used, last, count;
+};
+
+static void
+tpm_log_getpos(struct tpm_log_pos *pos)
+{
+    u8 *start = tpm_state.log_area_start_address;
+    pos->used = tpm_state.log_area_next_entry - start;
+    pos->last = (tpm_state.log_area_last_entry
+                 ? tpm_state.log_area_last_entry - start : 0);
+    pos->count = tpm_state.entry_count;
+}
+
+// Drop all log entries added after 'pos'
+static void
+tpm_log_rollback(struct tpm_log_pos *pos)
+{
+    u8 *start = tpm_state.log_area_start_address;
+    if (!start || pos->count == tpm_state.entry_count)
+        return;
+    dprintf(DEBUG_tcg, "TCGBIOS: Dropping %u log entries\n"
+            , tpm_state.entry_count - pos->count);
+    memset(start + pos->used, 0
+           , tpm_state.log_area_next_entry - (start + pos->used));
+    tpm_state.log_area_next_entry = start + pos->used;
+    tpm_state.log_area_last_entry = pos->count ? start + pos->last : NULL;
+    tpm_state.entry_count = pos->count;
 }
 
 /*
@@ -112,34 +246,35 @@ static int
 tpm_log_event(struct tpm_log_header *entry, int digest_len
               , const void *event, int event_len)
 {
-    dprintf(DEBUG_tcg, "TCGBIOS: LASA = %p, next entry = %p\n",
-            tpm_state.log_area_start_address, tpm_state.log_area_next_entry);
-
-    if (tpm_state.log_area_next_entry == NULL)
-        return -1;
-
     u32 size = (sizeof(*entry) + digest_len
                 + sizeof(struct tpm_log_trailer) + event_len);
-    u32 logsize = (tpm_state.log_area_next_entry + size
-                   - tpm_state.log_area_start_address);
-    if (logsize > tpm_state.log_area_minimum_length) {
-        dprintf(DEBUG_tcg, "TCGBIOS: LOG OVERFLOW: size = %d\n", size);
+    void *dest = tpm_log_reserve(size);
+    if (!dest)
         return -1;
-    }
 
-    void *dest = tpm_state.log_area_next_entry;
     memcpy(dest, entry, sizeof(*entry) + digest_len);
     struct tpm_log_trailer *t = dest + sizeof(*entry) + digest_len;
     t->eventdatasize = event_len;
     memcpy(t->event, event, event_len);
 
-    tpm_state.log_area_last_entry = tpm_state.log_area_next_entry;
-    tpm_state.log_area_next_entry += size;
-    tpm_state.entry_count++;
-
+    tpm_log_commit(size);
     return 0;
 }
 
+// Report how full the log is
+static void
+tpm_log_stats(void)
+{
+    if (!tpm_state.log_area_start_address)
+        return;
+    u32 used = (tpm_state.log_area_next_entry
+                - tpm_state.log_area_start_address);
+    u32 size = tpm_state.log_area_minimum_length;
+    dprintf(DEBUG_tcg, "TCGBIOS: Log: %u entries, %u of %u bytes used"
+            " (%u%%), moved %u times\n", tpm_state.entry_count, used, size
+            , size >= 100 ? used / (size / 100) : 0, tpm_log_moves);
+}
+
 
 /****************************************************************
  * Digest formatting
@@ -165,27 +300,32 @@ static const struct hash_parameters {
     u16 hashalg;
     u8  hashalg_flag;
     u8  hash_buffersize;
+    u8  sha_alg;
     const char *name;
 } hash_parameters[] = {
     {
         .hashalg = TPM2_ALG_SHA1,
         .hashalg_flag = TPM2_ALG_SHA1_FLAG,
         .hash_buffersize = SHA1_BUFSIZE,
+        .sha_alg = SHA_ALG_SHA1,
         .name = "SHA1",
     }, {
         .hashalg = TPM2_ALG_SHA256,
         .hashalg_flag = TPM2_ALG_SHA256_FLAG,
         .hash_buffersize = SHA256_BUFSIZE,
+        .sha_alg = SHA_ALG_SHA256,
         .name = "SHA256",
     }, {
         .hashalg = TPM2_ALG_SHA384,
         .hashalg_flag = TPM2_ALG_SHA384_FLAG,
         .hash_buffersize = SHA384_BUFSIZE,
+        .sha_alg = SHA_ALG_SHA384,
         .name = "SHA384",
     }, {
         .hashalg = TPM2_ALG_SHA512,
         .hashalg_flag = TPM2_ALG_SHA512_FLAG,
         .hash_buffersize = SHA512_BUFSIZE,
+        .sha_alg = SHA_ALG_SHA512,
         .name = "SHA512",
     }, {
         .hashalg = TPM2_ALG_SM3_256,
@@ -219,6 +359,19 @@ tpm20_hashalg_to_flag(u16 hashAlg)
     return 0;
 }
 
+// Return the SHA_ALG_* flag of the software hash for the given algorithm
+static u8
+tpm20_hashalg_to_sha_alg(u16 hashAlg)
+{
+    unsigned i;
+
+    for (i = 0; i < ARRAY_SIZE(hash_parameters); i++) {
+        if (hash_parameters[i].hashalg == hashAlg)
+            return hash_parameters[i].sha_alg;
+    }
+    return 0;
+}
+
 static u16
 tpm20_hashalg_flag_to_hashalg(u8 hashalg_flag)
 {
@@ -312,22 +465,23 @@ tpm20_write_EfiSpecIdEventStruct(void)
 }
 
 /*
- * Build the TPM2 tpm2_digest_values data structure from the given hash.
- * Follow the PCR bank configuration of the TPM and write the same hash
- * in either truncated or zero-padded form in the areas of all the other
- * hashes. For example, write the sha1 hash in the area of the sha256
- * hash and fill the remaining bytes with zeros. Or truncate the sha256
- * hash when writing it in the area of the sha1 hash.
+ * Build the TPM2 tpm2_digest_values data structure from the given hashes.
+ * Follow the PCR bank configuration of the TPM and write the digest of
+ * each bank's algorithm in its area.  Banks without a digest in 'digests'
+ * (inactive banks, algorithms without a software implementation, or
+ * callers that only supply a sha1 hash) get the sha1 hash written in
+ * truncated or zero-padded form.
  *
  * le: the log entry to build the digest in
- * sha1: the sha1 hash value to use
+ * digests: the hashes of the measured data
  * bigEndian: whether to build in big endian format for the TPM or
  *            little endian for the log
  *
  * Returns the digest size; -1 on fatal error
  */
 static int
-tpm20_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
+tpm20_build_digest(struct tpm_log_entry *le, struct sha_digests *digests
+                   , int bigEndian)
 {
     if (!tpm20_pcr_selection)
         return -1;
@@ -364,7 +518,13 @@ tpm20_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
             v->hashAlg = be16_to_cpu(sel->hashAlg);
 
         memset(v->hash, 0, hsize);
-        memcpy(v->hash, sha1, hsize > SHA1_BUFSIZE ? SHA1_BUFSIZE : hsize);
+        u8 *hash = sha_digest(digests, tpm20_hashalg_to_sha_alg(
+                                  be16_to_cpu(sel->hashAlg)));
+        if (hash)
+            memcpy(v->hash, hash, hsize);
+        else if ((hash = sha_digest(digests, SHA_ALG_SHA1)))
+            memcpy(v->hash, hash
+                   , hsize > SHA1_BUFSIZE ? SHA1_BUFSIZE : hsize);
 
         dest += sizeof(*v) + hsize;
         sel = nsel;
@@ -385,21 +545,22 @@ tpm20_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
 }
 
 static int
-tpm12_build_digest(struct tpm_log_entry *le, const u8 *sha1)
+tpm12_build_digest(struct tpm_log_entry *le, struct sha_digests *digests)
 {
     // On TPM 1.2 the digest contains just the SHA1 hash
-    memcpy(le->hdr.digest, sha1, SHA1_BUFSIZE);
+    memcpy(le->hdr.digest, digests->sha1, SHA1_BUFSIZE);
     return SHA1_BUFSIZE;
 }
 
 static int
-tpm_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
+tpm_build_digest(struct tpm_log_entry *le, struct sha_digests *digests
+                 , int bigEndian)
 {
     switch (TPM_version) {
     case TPM_VERSION_1_2:
-        return tpm12_build_digest(le, sha1);
+        return tpm12_build_digest(le, digests);
     case TPM_VERSION_2:
-        return tpm20_build_digest(le, sha1, bigEndian);
+        return tpm20_build_digest(le, digests, bigEndian);
     }
     return -1;
 }
@@ -409,6 +570,84 @@ tpm_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
  * TPM hardware command wrappers
  ****************************************************************/
 
+/*
+ * Cache of GetCapability responses.  The reported capabilities only
+ * change when a command that modifies the TPM state is sent, so
+ * repeated queries (eg, when redrawing the TPM menu) are answered from
+ * memory until tpm_capcache_invalidate() is called.  The cache only
+ * exists during POST.
+ */
+#define TPM_CAPCACHE_ENTRIES   4
+#define TPM_CAPCACHE_RESP_SIZE 128
+
+static struct tpm_capcache_entry {
+    u32 capability, property, count;
+    u32 size;
+    u8 resp[TPM_CAPCACHE_RESP_SIZE];
+} *tpm_capcache;
+static int tpm_capcache_next;
+
+static void
+tpm_capcache_setup(void)
+{
+    tpm_capcache = malloc_tmp(TPM_CAPCACHE_ENTRIES * sizeof(*tpm_capcache));
+    if (!tpm_capcache)
+        return;
+    memset(tpm_capcache, 0, TPM_CAPCACHE_ENTRIES * sizeof(*tpm_capcache));
+}
+
+static void
+tpm_capcache_free(void)
+{
+    free(tpm_capcache);
+    tpm_capcache = NULL;
+}
+
+static void
+tpm_capcache_invalidate(void)
+{
+    if (!tpm_capcache)
+        return;
+    int i;
+    for (i = 0; i < TPM_CAPCACHE_ENTRIES; i++)
+        tpm_capcache[i].size = 0;
+}
+
+// Copy a cached response into 'rsp'; returns 0 on a cache hit
+static int
+tpm_capcache_get(u32 capability, u32 property, u32 count,
+                 struct tpm_rsp_header *rsp, u32 *rsize)
+{
+    if (!tpm_capcache)
+        return -1;
+    int i;
+    for (i = 0; i < TPM_CAPCACHE_ENTRIES; i++) {
+        struct tpm_capcache_entry *ce = &tpm_capcache[i];
+        if (ce->size && ce->size <= *rsize && ce->capability == capability
+            && ce->property == property && ce->count == count) {
+            memcpy(rsp, ce->resp, ce->size);
+            *rsize = ce->size;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void
+tpm_capcache_put(u32 capability, u32 property, u32 count,
+                 const struct tpm_rsp_header *rsp, u32 size)
+{
+    if (!tpm_capcache || !size || size > TPM_CAPCACHE_RESP_SIZE)
+        return;
+    struct tpm_capcache_entry *ce = &tpm_capcache[tpm_capcache_next];
+    tpm_capcache_next = (tpm_capcache_next + 1) % TPM_CAPCACHE_ENTRIES;
+    ce->capability = capability;
+    ce->property = property;
+    ce->count = count;
+    ce->size = size;
+    memcpy(ce->resp, rsp, size);
+}
+
 // Helper function for sending tpm commands that take a single
 // optional parameter (0, 1, or 2 bytes) and have no special response.
 static int
@@ -437,6 +676,7 @@ tpm_simple_cmd(u8 locty, u32 ordinal
     u32 obuffer_len = sizeof(obuffer);
     memset(obuffer, 0x0, sizeof(obuffer));
 
+    tpm_capcache_invalidate();
     int ret = tpmhw_transmit(locty, &req.trqh, obuffer, &obuffer_len, to_t);
     ret = ret ? -1 : be32_to_cpu(trsh->errcode);
     dprintf(DEBUG_tcg, "Return from tpm_simple_cmd(%x, %x) = %x\n",
@@ -458,10 +698,15 @@ tpm20_getcapability(u32 capability, u32 property, u32 count,
     };
 
     u32 resp_size = rsize;
+    if (!tpm_capcache_get(capability, property, count, rsp, &resp_size))
+        return 0;
+
     int ret = tpmhw_transmit(0, &trg.hdr, rsp, &resp_size,
                              TPM_DURATION_TYPE_SHORT);
     ret = (ret ||
            rsize < be32_to_cpu(rsp->totlen)) ? -1 : be32_to_cpu(rsp->errcode);
+    if (!ret)
+        tpm_capcache_put(capability, property, count, rsp, resp_size);
 
     dprintf(DEBUG_tcg, "TCGBIOS: Return value from sending TPM2_CC_GetCapability = 0x%08x\n",
             ret);
@@ -595,6 +840,7 @@ tpm20_set_pcrbanks(u32 active_banks)
     struct tpm_rsp_header rsp;
     u32 resp_length = sizeof(rsp);
 
+    tpm_capcache_invalidate();
     int ret = tpmhw_transmit(0, &trpa.hdr, &rsp, &resp_length,
                              TPM_DURATION_TYPE_SHORT);
     ret = ret ? -1 : be32_to_cpu(rsp.errcode);
@@ -602,6 +848,27 @@ tpm20_set_pcrbanks(u32 active_banks)
     return ret;
 }
 
+// Return the SHA_ALG_* flags of the hashes needed by the active PCR banks
+static u8
+tpm_get_sha_algs(void)
+{
+    switch (TPM_version) {
+    case TPM_VERSION_1_2:
+        return SHA_ALG_SHA1;
+    case TPM_VERSION_2: ;
+        u8 suppt_banks, active_banks, algs = 0;
+        unsigned i;
+
+        tpm20_get_suppt_pcrbanks(&suppt_banks, &active_banks);
+        for (i = 0; i < ARRAY_SIZE(hash_parameters); i++) {
+            if (active_banks & hash_parameters[i].hashalg_flag)
+                algs |= hash_parameters[i].sha_alg;
+        }
+        return algs;
+    }
+    return 0;
+}
+
 static int tpm20_activate_pcrbanks(u32 active_banks)
 {
     int ret = tpm20_set_pcrbanks(active_banks);
@@ -625,9 +892,16 @@ tpm12_get_capability(u32 cap, u32 subcap, struct tpm_rsp_header *rsp, u32 rsize)
         .subCap = cpu_to_be32(subcap)
     };
     u32 resp_size = rsize;
+    if (!tpm_capcache_get(cap, subcap, 0, rsp, &resp_size)
+        && resp_size == rsize)
+        return 0;
+
+    resp_size = rsize;
     int ret = tpmhw_transmit(0, &trgc.hdr, rsp, &resp_size,
                              TPM_DURATION_TYPE_SHORT);
     ret = (ret || resp_size != rsize) ? -1 : be32_to_cpu(rsp->errcode);
+    if (!ret)
+        tpm_capcache_put(cap, subcap, 0, rsp, resp_size);
     dprintf(DEBUG_tcg, "TCGBIOS: Return code from TPM_GetCapability(%d, %d)"
             " = %x\n", cap, subcap, ret);
     return ret;
@@ -726,14 +1000,17 @@ tpm12_extend(struct tpm_log_entry *le, int digest_len)
     return 0;
 }
 
-static int tpm20_extend(struct tpm_log_entry *le, int digest_len)
+// Build a TPM2_PCR_Extend command in 'tre' and send it
+static int
+tpm20_send_extend(struct tpm2_req_extend *tre, struct tpm_log_entry *le
+                  , int digest_len)
 {
-    struct tpm2_req_extend tmp_tre = {
+    *tre = (struct tpm2_req_extend) {
         .hdr.tag     = cpu_to_be16(TPM2_ST_SESSIONS),
-        .hdr.totlen  = cpu_to_be32(0),
+        .hdr.totlen  = cpu_to_be32(sizeof(*tre) + digest_len),
         .hdr.ordinal = cpu_to_be32(TPM2_CC_PCR_Extend),
         .pcrindex    = cpu_to_be32(le->hdr.pcrindex),
-        .authblocksize = cpu_to_be32(sizeof(tmp_tre.authblock)),
+        .authblocksize = cpu_to_be32(sizeof(tre->authblock)),
         .authblock = {
             .handle = cpu_to_be32(TPM2_RS_PW),
             .noncesize = cpu_to_be16(0),
@@ -741,24 +1018,37 @@ static int tpm20_extend(struct tpm_log_entry *le, int digest_len)
             .pwdsize = cpu_to_be16(0),
         },
     };
-    u8 buffer[sizeof(tmp_tre) + sizeof(le->pad)];
-    struct tpm2_req_extend *tre = (struct tpm2_req_extend *)buffer;
-
-    memcpy(tre, &tmp_tre, sizeof(tmp_tre));
     memcpy(&tre->digest[0], le->hdr.digest, digest_len);
 
-    tre->hdr.totlen = cpu_to_be32(sizeof(tmp_tre) + digest_len);
-
-    struct tpm_rsp_header rsp;
-    u32 resp_length = sizeof(rsp);
-    int ret = tpmhw_transmit(0, &tre->hdr, &rsp, &resp_length,
+    struct tpm_rsp_header rspbuf, *rsp = tpmhw_get_resp_buffer(sizeof(*rsp));
+    if (!rsp)
+        rsp = &rspbuf;
+    u32 resp_length = sizeof(*rsp);
+    int ret = tpmhw_transmit(0, &tre->hdr, rsp, &resp_length,
                              TPM_DURATION_TYPE_SHORT);
-    if (ret || resp_length != sizeof(rsp) || rsp.errcode)
+    if (ret || resp_length != sizeof(*rsp) || rsp->errcode)
         return -1;
 
     return 0;
 }
 
+static noinline int
+tpm20_extend_buffered(struct tpm_log_entry *le, int digest_len)
+{
+    u8 buffer[sizeof(struct tpm2_req_extend) + sizeof(le->pad)];
+    return tpm20_send_extend((void*)buffer, le, digest_len);
+}
+
+static int tpm20_extend(struct tpm_log_entry *le, int digest_len)
+{
+    // Build the command directly in the CRB command buffer if possible
+    struct tpm2_req_extend *tre = tpmhw_get_cmd_buffer(
+        0, sizeof(*tre) + digest_len);
+    if (!tre)
+        return tpm20_extend_buffered(le, digest_len);
+    return tpm20_send_extend(tre, le, digest_len);
+}
+
 static int
 tpm_extend(struct tpm_log_entry *le, int digest_len)
 {
@@ -847,6 +1137,7 @@ tpm20_hierarchycontrol(u32 hierarchy, u8 state)
     };
     struct tpm_rsp_header rsp;
     u32 resp_length = sizeof(rsp);
+    tpm_capcache_invalidate();
     int ret = tpmhw_transmit(0, &trh.hdr, &rsp, &resp_length,
                              TPM_DURATION_TYPE_MEDIUM);
     if (ret || resp_length != sizeof(rsp) || rsp.errcode)
@@ -881,6 +1172,7 @@ tpm20_hierarchychangeauth(u8 auth[20])
 
     struct tpm_rsp_header rsp;
     u32 resp_length = sizeof(rsp);
+    tpm_capcache_invalidate();
     int ret = tpmhw_transmit(0, &trhca.hdr, &rsp, &resp_length,
                              TPM_DURATION_TYPE_MEDIUM);
     if (ret || resp_length != sizeof(rsp) || rsp.errcode)
@@ -900,6 +1192,23 @@ tpm20_hierarchychangeauth(u8 auth[20])
 static int TPM_has_physical_presence;
 u8 TPM_working VARLOW;
 
+// PCR extends of the POST measurements are queued and sent to the TPM
+// in bursts; the queue only exists between tpm_setup() and the end of
+// tpm_prepboot().
+#define TPM_EXTEND_QUEUE_SIZE 16
+
+static struct tpm_queued_extend {
+    struct tpm_log_entry le;
+    int digest_len;
+    // log position before the entry of this measurement
+    struct tpm_log_pos logpos;
+} *tpm_extend_queue;
+static int tpm_extend_queue_count;
+
+static struct {
+    u32 flushes, extends, usecs, max_usecs;
+} tpm_extend_stats;
+
 static int
 tpm_is_working(void)
 {
@@ -926,45 +1235,181 @@ tpm_set_failure(void)
     }
 
     TPM_working = 0;
+    tpm_extend_queue_count = 0;
+}
+
+static void
+tpm_extend_queue_start(void)
+{
+    tpm_extend_queue = malloc_tmp(TPM_EXTEND_QUEUE_SIZE
+                                  * sizeof(*tpm_extend_queue));
+    if (!tpm_extend_queue)
+        warn_noalloc();
+    tpm_extend_queue_count = 0;
+}
+
+// Send all queued PCR extends to the TPM in one burst.  Must be called
+// before any measured code is run.
+static void
+tpm_extend_queue_flush(void)
+{
+    int count = tpm_extend_queue_count, i;
+    if (!count)
+        return;
+    tpm_extend_queue_count = 0;
+
+    u32 start = timer_read();
+    tpmhw_start_burst();
+    for (i = 0; i < count; i++) {
+        struct tpm_queued_extend *qe = &tpm_extend_queue[i];
+        int ret = tpm_extend(&qe->le, qe->digest_len);
+        if (ret) {
+            tpmhw_end_burst();
+            // Only measurements extended into the PCRs may be in the log
+            tpm_log_rollback(&qe->logpos);
+            tpm_set_failure();
+            return;
+        }
+    }
+    tpmhw_end_burst();
+    u32 usecs = timer_elapsed_usec(start);
+
+    tpm_extend_stats.flushes++;
+    tpm_extend_stats.extends += count;
+    tpm_extend_stats.usecs += usecs;
+    if (usecs > tpm_extend_stats.max_usecs)
+        tpm_extend_stats.max_usecs = usecs;
+    dprintf(DEBUG_tcg, "TCGBIOS: Flushed %d PCR extends in %u us\n"
+            , count, usecs);
+}
+
+static void
+tpm_extend_queue_stop(void)
+{
+    if (!tpm_extend_queue)
+        return;
+    tpm_extend_queue_flush();
+    free(tpm_extend_queue);
+    tpm_extend_queue = NULL;
+    dprintf(DEBUG_tcg, "TCGBIOS: %u PCR extends in %u flushes, %u us"
+            " (max %u us)\n", tpm_extend_stats.extends
+            , tpm_extend_stats.flushes, tpm_extend_stats.usecs
+            , tpm_extend_stats.max_usecs);
+}
+
+// Extend a PCR - queued if possible
+static int
+tpm_extend_queued(struct tpm_log_entry *le, int digest_len)
+{
+    if (!tpm_extend_queue)
+        return tpm_extend(le, digest_len);
+    if (tpm_extend_queue_count >= TPM_EXTEND_QUEUE_SIZE) {
+        tpm_extend_queue_flush();
+        if (!tpm_is_working())
+            return -1;
+    }
+    struct tpm_queued_extend *qe = &tpm_extend_queue[tpm_extend_queue_count];
+    tpm_extend_queue_count++;
+    memcpy(&qe->le, le, sizeof(*le));
+    qe->digest_len = digest_len;
+    tpm_log_getpos(&qe->logpos);
+    return 0;
 }
 
 /*
- * Add a measurement to the log; the data at data_seg:data/length are
- * appended to the TCG_PCClientPCREventStruct
+ * Add a measurement of data hashed with a sha_ctx to the log
  *
  * Input parameters:
  *  pcrindex   : which PCR to extend
  *  event_type : type of event; specs section on 'Event Types'
  *  event       : pointer to info (e.g., string) to be added to log as-is
  *  event_length: length of the event
- *  hashdata    : pointer to the data to be hashed
- *  hashdata_length: length of the data to be hashed
+ *  ctx         : hash context (from tpm_measure_start()) fed with the data
  */
 static void
-tpm_add_measurement_to_log(u32 pcrindex, u32 event_type,
+tpm_add_hashed_measurement(u32 pcrindex, u32 event_type,
                            const char *event, u32 event_length,
-                           const u8 *hashdata, u32 hashdata_length)
+                           struct sha_ctx *ctx)
 {
     if (!tpm_is_working())
         return;
 
-    u8 hash[SHA1_BUFSIZE];
-    sha1(hashdata, hashdata_length, hash);
+    struct sha_digests digests;
+    sha_final(ctx, &digests);
 
     struct tpm_log_entry le = {
         .hdr.pcrindex = pcrindex,
         .hdr.eventtype = event_type,
     };
-    int digest_len = tpm_build_digest(&le, hash, 1);
+    int digest_len = tpm_build_digest(&le, &digests, 1);
     if (digest_len < 0)
         return;
-    int ret = tpm_extend(&le, digest_len);
+    int ret = tpm_extend_queued(&le, digest_len);
     if (ret) {
         tpm_set_failure();
         return;
     }
-    tpm_build_digest(&le, hash, 0);
-    tpm_log_event(&le.hdr, digest_len, event, event_length);
+
+    // Build the log entry in place
+    u32 size = (sizeof(le.hdr) + digest_len
+                + sizeof(struct tpm_log_trailer) + event_length);
+    struct tpm_log_entry *entry = tpm_log_reserve(size);
+    if (!entry)
+        return;
+    entry->hdr.pcrindex = pcrindex;
+    entry->hdr.eventtype = event_type;
+    tpm_build_digest(entry, &digests, 0);
+    struct tpm_log_trailer *t = (void*)entry->hdr.digest + digest_len;
+    t->eventdatasize = event_length;
+    memcpy(t->event, event, event_length);
+    tpm_log_commit(size);
+}
+
+/*
+ * Add a measurement to the log; the data at data_seg:data/length are
+ * appended to the TCG_PCClientPCREventStruct
+ *
+ * Input parameters:
+ *  pcrindex   : which PCR to extend
+ *  event_type : type of event; specs section on 'Event Types'
+ *  event       : pointer to info (e.g., string) to be added to log as-is
+ *  event_length: length of the event
+ *  hashdata    : pointer to the data to be hashed
+ *  hashdata_length: length of the data to be hashed
+ */
+static void
+tpm_add_measurement_to_log(u32 pcrindex, u32 event_type,
+                           const char *event, u32 event_length,
+                           const u8 *hashdata, u32 hashdata_length)
+{
+    if (!tpm_is_working())
+        return;
+
+    struct sha_ctx ctx;
+    tpm_measure_start(&ctx);
+    sha_update(&ctx, hashdata, hashdata_length);
+    tpm_add_hashed_measurement(pcrindex, event_type, event, event_length
+                               , &ctx);
+}
+
+/*
+ * Incremental measurements: data that is loaded piece by piece (eg,
+ * payload segments) is hashed as it arrives with tpm_measure_data()
+ * and only logged once complete - no copy of the whole object is
+ * needed.
+ */
+void
+tpm_measure_start(struct sha_ctx *ctx)
+{
+    sha_init(ctx, tpm_is_working() ? tpm_get_sha_algs() : 0);
+}
+
+void
+tpm_measure_data(struct sha_ctx *ctx, const void *data, u32 len)
+{
+    if (!ctx->algs)
+        return;
+    sha_update(ctx, data, len);
 }
 
 // Add an EV_ACTION measurement to the list of measurements
@@ -1169,14 +1614,142 @@ tpm_setup(void)
     if (runningOnXen())
         return;
 
+    tpm_capcache_setup();
+
     ret = tpm_startup();
     if (ret)
         return;
 
+    tpm_log_make_room(TPM_LOG_HEADROOM);
+    tpm_extend_queue_start();
     tpm_smbios_measure();
     tpm_add_action(2, "Start Option ROM Scan");
 }
 
+/*
+ * Add measurement to the log about an option rom given its sha1 hash
+ */
+static void
+tpm_option_rom_log(const u8 *sha1)
+{
+    tpm_log_make_room(TPM_LOG_HEADROOM);
+
+    struct pcctes_romex pcctes = {
+        .eventid = 7,
+        .eventdatasize = sizeof(u16) + sizeof(u16) + SHA1_BUFSIZE,
+    };
+    memcpy(pcctes.digest, sha1, SHA1_BUFSIZE);
+    tpm_add_measurement_to_log(2,
+                               EV_EVENT_TAG,
+                               (const char *)&pcctes, sizeof(pcctes),
+                               (u8 *)&pcctes, sizeof(pcctes));
+}
+
+/*
+ * Option roms that are not run right away are copied and hashed by a
+ * background thread.  The measurements are added in the original
+ * order once all hashes before them are complete - at the latest when
+ * tpm_prepboot() is called, which is before these roms are run.
+ */
+#define TPM_ROM_HASH_CHUNK 4096
+
+struct tpm_pending_rom {
+    struct tpm_pending_rom *next;
+    void *data;
+    u32 len;
+    int done;
+    struct sha_digests digests;
+};
+static struct tpm_pending_rom *tpm_pending_roms, **tpm_pending_roms_tail;
+
+static void
+tpm_option_rom_hash(void *data)
+{
+    struct tpm_pending_rom *pr = data;
+    struct sha_ctx ctx;
+    u32 pos;
+    sha_init(&ctx, SHA_ALG_SHA1);
+    for (pos = 0; pos < pr->len; pos += TPM_ROM_HASH_CHUNK) {
+        u32 len = pr->len - pos;
+        if (len > TPM_ROM_HASH_CHUNK)
+            len = TPM_ROM_HASH_CHUNK;
+        sha_update(&ctx, pr->data + pos, len);
+        yield();
+    }
+    sha_final(&ctx, &pr->digests);
+    pr->done = 1;
+}
+
+// Wait for all pending option rom hashes and add their measurements
+static void
+tpm_option_rom_join(void)
+{
+    while (tpm_pending_roms) {
+        struct tpm_pending_rom *pr = tpm_pending_roms;
+        while (!pr->done)
+            yield();
+        tpm_pending_roms = pr->next;
+        if (tpm_is_working())
+            tpm_option_rom_log(pr->digests.sha1);
+        free(pr->data);
+        free(pr);
+    }
+    tpm_pending_roms_tail = NULL;
+}
+
+/*
+ * Add measurement to the log about an option rom
+ */
+void
+tpm_option_rom(const void *addr, u32 len)
+{
+    if (!tpm_is_working())
+        return;
+
+    tpm_option_rom_join();
+
+    struct sha_ctx ctx;
+    struct sha_digests digests;
+    sha_init(&ctx, SHA_ALG_SHA1);
+    sha_update(&ctx, addr, len);
+    sha_final(&ctx, &digests);
+    tpm_option_rom_log(digests.sha1);
+    // The rom may be run right after it is measured
+    tpm_extend_queue_flush();
+}
+
+/*
+ * Measure an option rom that is run later (not before tpm_prepboot())
+ */
+void
+tpm_option_rom_lazy(const void *addr, u32 len)
+{
+    if (!CONFIG_TCGBIOS_LAZY_ROM_HASH) {
+        tpm_option_rom(addr, len);
+        return;
+    }
+    if (!tpm_is_working())
+        return;
+
+    struct tpm_pending_rom *pr = malloc_tmp(sizeof(*pr));
+    void *data = malloc_tmphigh(len);
+    if (!pr || !data) {
+        free(pr);
+        free(data);
+        tpm_option_rom(addr, len);
+        return;
+    }
+    memset(pr, 0, sizeof(*pr));
+    memcpy(data, addr, len);
+    pr->data = data;
+    pr->len = len;
+    if (!tpm_pending_roms_tail)
+        tpm_pending_roms_tail = &tpm_pending_roms;
+    *tpm_pending_roms_tail = pr;
+    tpm_pending_roms_tail = &pr->next;
+    run_thread(tpm_option_rom_hash, pr);
+}
+
 static void
 tpm20_prepboot(void)
 {
@@ -1207,6 +1780,12 @@ tpm_prepboot(void)
     if (!CONFIG_TCGBIOS)
         return;
 
+    // Measure the remaining option roms before any of them is run
+    tpm_option_rom_join();
+
+    // Leave room for the measurements below and those made at boot
+    tpm_log_make_room(2 * TPM_LOG_HEADROOM);
+
     switch (TPM_version) {
     case TPM_VERSION_1_2:
         if (TPM_has_physical_presence)
@@ -1220,26 +1799,11 @@ tpm_prepboot(void)
 
     tpm_add_action(4, "Calling INT 19h");
     tpm_add_event_separators();
-}
-
-/*
- * Add measurement to the log about an option rom
- */
-void
-tpm_option_rom(const void *addr, u32 len)
-{
-    if (!tpm_is_working())
-        return;
-
-    struct pcctes_romex pcctes = {
-        .eventid = 7,
-        .eventdatasize = sizeof(u16) + sizeof(u16) + SHA1_BUFSIZE,
-    };
-    sha1((const u8 *)addr, len, pcctes.digest);
-    tpm_add_measurement_to_log(2,
-                               EV_EVENT_TAG,
-                               (const char *)&pcctes, sizeof(pcctes),
-                               (u8 *)&pcctes, sizeof(pcctes));
+    tpm_extend_queue_stop();
+    tpm_capcache_free();
+    tpm_log_stats();
+    if (tpmhw_is_present())
+        tpmhw_dump_latency();
 }
 
 void
@@ -1300,6 +1864,17 @@ tpm_add_cdrom_catalog(const u8 *addr, u32 length)
                                addr, length);
 }
 
+// Add the measurement of a payload loaded with tpm_measure_data()
+void
+tpm_add_cbfs_payload(struct sha_ctx *ctx, const char *filename)
+{
+    if (!tpm_is_working())
+        return;
+
+    tpm_add_action(4, "Booting from CBFS payload");
+    tpm_add_hashed_measurement(4, EV_IPL, filename, strlen(filename), ctx);
+}
+
 void
 tpm_s3_resume(void)
 {
@@ -1369,14 +1944,24 @@ hash_log_extend(struct pcpes *pcpes, const void *hashdata, u32 hashdata_length
 {
     if (pcpes->pcrindex >= 24)
         return TCG_INVALID_INPUT_PARA;
-    if (hashdata)
-        sha1(hashdata, hashdata_length, pcpes->digest);
+
+    struct sha_digests digests;
+    if (hashdata) {
+        // The interface always reports back the sha1 hash
+        sha_multi(tpm_get_sha_algs() | SHA_ALG_SHA1
+                  , hashdata, hashdata_length, &digests);
+        memcpy(pcpes->digest, digests.sha1, SHA1_BUFSIZE);
+    } else {
+        // Caller only provided a sha1 hash of the data
+        digests.algs = SHA_ALG_SHA1;
+        memcpy(digests.sha1, pcpes->digest, SHA1_BUFSIZE);
+    }
 
     struct tpm_log_entry le = {
         .hdr.pcrindex = pcpes->pcrindex,
         .hdr.eventtype = pcpes->eventtype,
     };
-    int digest_len = tpm_build_digest(&le, pcpes->digest, 1);
+    int digest_len = tpm_build_digest(&le, &digests, 1);
     if (digest_len < 0)
         return TCG_GENERAL_ERROR;
     if (extend) {
@@ -1384,7 +1969,7 @@ hash_log_extend(struct pcpes *pcpes, const void *hashdata, u32 hashdata_length
         if (ret)
             return TCG_TCG_COMMAND_ERROR;
     }
-    tpm_build_digest(&le, pcpes->digest, 0);
+    tpm_build_digest(&le, &digests, 0);
     int ret = tpm_log_event(&le.hdr, digest_len
                             , pcpes->event, pcpes->eventdatasize);
     if (ret)
@@ -1482,6 +2067,7 @@ pass_through_to_tpm_int(struct pttti *pttti, struct pttto *pttto)
     }
 
     u32 resbuflen = pttti->opblength - offsetof(struct pttto, tpmopout);
+    tpm_capcache_invalidate();
     int ret = tpmhw_transmit(0, trh, pttto->tpmopout, &resbuflen,
                              TPM_DURATION_TYPE_LONG /* worst case */);
     if (ret) {
@@ -1892,6 +2478,7 @@ tpm20_clearcontrol(u8 disable, int verbose)
     };
     struct tpm_rsp_header rsp;
     u32 resp_length = sizeof(rsp);
+    tpm_capcache_invalidate();
     int ret = tpmhw_transmit(0, &trc.hdr, &rsp, &resp_length,
                              TPM_DURATION_TYPE_SHORT);
     if (ret || resp_length != sizeof(rsp) || rsp.errcode)
@@ -1921,6 +2508,7 @@ tpm20_clear(void)
     };
     struct tpm_rsp_header rsp;
     u32 resp_length = sizeof(rsp);
+    tpm_capcache_invalidate();
     int ret = tpmhw_transmit(0, &trq.hdr, &rsp, &resp_length,
                              TPM_DURATION_TYPE_MEDIUM);
     if (ret || resp_length != sizeof(rsp) || rsp.errcode)
@@ -13,6 +13,11 @@ void tpm_add_bcv(u32 bootdrv, const u8 *addr, u32 length);
 void tpm_add_cdrom(u32 bootdrv, const u8 *addr, u32 length);
 void tpm_add_cdrom_catalog(const u8 *addr, u32 length);
 void tpm_option_rom(const void *addr, u32 len);
+void tpm_option_rom_lazy(const void *addr, u32 len);
+struct sha_ctx;
+void tpm_measure_start(struct sha_ctx *ctx);
+void tpm_measure_data(struct sha_ctx *ctx, const void *data, u32 len);
+void tpm_add_cbfs_payload(struct sha_ctx *ctx, const char *filename);
 int tpm_can_show_menu(void);
 void tpm_menu(void);
 
@@ -44,6 +44,10 @@ int boot_lchs_find_scsi_device(struct pci_device *pci, int target, int lun,
                                struct chs_s *chs);
 int boot_lchs_find_ata_device(struct pci_device *pci, int chanid, int slave,
                               struct chs_s *chs);
+#define FASTBOOT_BLOCK 1
+#define FASTBOOT_USB   2
+int fastboot_target(void);
+int fastboot_found(void);
 
 // bootsplash.c
 void enable_vga_console(void);
@@ -170,6 +174,8 @@ void sdcard_setup(void);
 // hw/timer.c
 void timer_setup(void);
 void pmtimer_setup(u16 ioport);
+u32 timer_read(void);
+u32 timer_elapsed_usec(u32 start);
 u32 timer_calc(u32 msecs);
 u32 timer_calc_usec(u32 usecs);
 int timer_check(u32 end);
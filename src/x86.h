@@ -198,6 +198,11 @@ static inline void smp_rmb(void) {
 static inline void smp_wmb(void) {
     barrier();
 }
+/* ... but it may move a read ahead of an earlier write - a locked
+ * instruction orders both. */
+static inline void smp_mb(void) {
+    asm volatile("lock; orl $0, (%%esp)" : : : "memory", "cc");
+}
 
 static inline void writel(void *addr, u32 val) {
     barrier();